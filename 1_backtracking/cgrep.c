@@ -1,18 +1,26 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define BUFLEN 200
 #define MAXINPUTS 10
+#define READ_BLOCK (256 * 1024) // bytes requested from read() at a time
 
 int match(const char* regex, const char* text);
 int matchhere(const char* regex, const char* text);
 int matchstar(char c, const char* regex, const char* text);
+int grep_fd(const char* regex, int fd, const char* name);
 
 int main(int argc, const char* argv[])
 {
-  FILE* inputs[MAXINPUTS] = {stdin};
-  FILE* input;
+  int inputs[MAXINPUTS] = {STDIN_FILENO};
+  const char* names[MAXINPUTS] = {"(standard input)"};
+  int input;
   int num_in = 1;
+  int status = 0;
   char regex[BUFLEN];
   if (argc < 2) {
     fprintf(stderr, "Need at least a regular expression\n");
@@ -24,23 +32,81 @@ int main(int argc, const char* argv[])
   if (argc >= 3) {
     num_in = 0;
     for (int i = 2; i < argc; i++) {
-      if (!(input = fopen(argv[i], "r"))) {
+      if ((input = open(argv[i], O_RDONLY)) < 0) {
         fprintf(stderr, "Can't open file '%s'\n", argv[i]);
         return 1;
       }
       inputs[i - 2] = input;
+      names[i - 2] = argv[i];
       num_in++;
     }
   }
-  char buf[BUFLEN];
   while (--num_in >= 0) {
-    while (fgets(buf, BUFLEN, inputs[num_in])) {
-      buf[strlen(buf) - 1] = '\0'; // get rid of newline at the end
-      if (match(regex, buf)) {
-        printf("%s\n", buf);
-      }
+    if (grep_fd(regex, inputs[num_in], names[num_in]))
+      status = 1;
+    close(inputs[num_in]);
+  }
+  return status;
+}
+
+// Read all of 'fd' in blocks of READ_BLOCK bytes and print every line that
+// matches.
+// Line boundaries are found with memchr. A line which is cut off at the end of
+// a block is moved to the front of the buffer and completed by the next read,
+// growing the buffer if necessary, so there is no limit on the line length.
+int grep_fd(const char* regex, int fd, const char* name)
+{
+  size_t cap = READ_BLOCK;
+  size_t len = 0;     // bytes of input currently in buf
+  size_t scanned = 0; // bytes at the start of buf known to contain no '\n'
+  char* buf = malloc(cap);
+  char* line;
+  char* nl;
+  ssize_t n;
+
+  for (;;) {
+    if (len == cap) { // a single line fills the whole buffer
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    n = read(fd, buf + len, cap - len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Can't read file '%s'\n", name);
+      free(buf);
+      return 1;
     }
+    if (n == 0)
+      break;
+    len += n;
+
+    line = buf;
+    nl = memchr(buf + scanned, '\n', len - scanned);
+    while (nl != NULL) {
+      *nl = '\0'; // the matcher works on '\0' terminated strings
+      if (match(regex, line))
+        printf("%s\n", line);
+      line = nl + 1;
+      nl = memchr(line, '\n', buf + len - line);
+    }
+
+    // keep the incomplete last line for the next read
+    len -= line - buf;
+    memmove(buf, line, len);
+    scanned = len;
   }
+
+  // last line had no '\n', there is always space for the '\0' since the
+  // buffer is grown before it is full
+  if (len > 0) {
+    line = buf;
+    line[len] = '\0';
+    if (match(regex, line))
+      printf("%s\n", line);
+  }
+  free(buf);
+  return 0;
 }
 
 // this will match the following regular expressions
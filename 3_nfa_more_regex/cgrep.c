@@ -8,15 +8,20 @@
  * - () for grouping regular expressions
  *
  * This is implemented using a non-deterministic finite automaton, i.e. a
- * non-deterministic finite state machine
+ * non-deterministic finite state machine, which is simulated in lockstep: all
+ * states it can be in are advanced over each character at once
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define BUFLEN 200
 #define MAXINPUTS 10
+#define READ_BLOCK (256 * 1024) // bytes requested from read() at a time
 
 
 typedef struct next_l_edge {
@@ -27,6 +32,7 @@ typedef struct next_l_edge {
 } next_l_edge;
 
 typedef struct nfa_node {
+  int id;  // 0 to num_nodes - 1, see number_nodes
   int isend;
   struct next_l_edge* next_l;
 } nfa_node;
@@ -37,35 +43,49 @@ typedef struct nfa {
   struct nfa_node* end;
 } nfa;
 
-typedef struct cnl_field {
-  const char* text;
-  struct nfa_node* node;
-  struct cnl_field* next;
-} cnl_field;
+// Set of node ids with constant time insert, lookup and clear. An id is in
+// the set if its entry in 'sparse' points to an entry of 'dense' which holds
+// it, so clearing it only resets 'count'.
+typedef struct sparse_set {
+  int* dense;  // the ids in the order they were inserted
+  int* sparse; // position of each id in 'dense'
+  int count;
+} sparse_set;
 
 typedef struct RE {
   int match_start;
   int match_end;
   struct nfa* re_nfa;
+  // everything RE_run needs, allocated once by RE_gen
+  nfa_node** nodes; // nodes by id
+  sparse_set curr;  // states before the current character
+  sparse_set next;  // states after it
+  nfa_node** stack; // nodes whose always edges add_closure still has to follow
 } RE;
 
 int char_match(char matcher, char source);
 int RE_run(RE* re, const char* regex, const char* text);
 RE* RE_gen(char* regex);
 void RE_destroy(RE* re);
-cnl_field* insert_node_into_cnl(cnl_field* start, nfa_node* node_ptr, const char* text);
-cnl_field* remove_node_from_cnl(cnl_field* start, cnl_field* rm_ptr);
+void add_closure(RE* re, sparse_set* set, nfa_node* node);
 next_l_edge* insert_next_edge(next_l_edge* start, int always, char cond_ch, nfa_node* node);
 nfa* generate_nfa(const char* regex);
-void free_nfa(nfa* nfa_init);
-void free_cnl(cnl_field* start);
+nfa_node** number_nodes(nfa* nfa_in);
+void free_nfa(nfa* nfa_init, nfa_node** nodes);
 int is_node_in_list(nfa_node** list, nfa_node* node, int list_size);
+void sparse_set_init(sparse_set* set, int size);
+void sparse_set_free(sparse_set* set);
+int sparse_set_has(sparse_set* set, int id);
+void sparse_set_add(sparse_set* set, int id);
+int grep_fd(RE* re, const char* regex, int fd, const char* name);
 
 int main(int argc, const char* argv[])
 {
-  FILE* inputs[MAXINPUTS] = {stdin};
-  FILE* input;
+  int inputs[MAXINPUTS] = {STDIN_FILENO};
+  const char* names[MAXINPUTS] = {"(standard input)"};
+  int input;
   int num_in = 1;
+  int status = 0;
   char regex[BUFLEN];
   if (argc < 2) {
     fprintf(stderr, "Need at least a regular expression\n");
@@ -77,27 +97,84 @@ int main(int argc, const char* argv[])
   if (argc >= 3) {
     num_in = 0;
     for (int i = 2; i < argc; i++) {
-      if (!(input = fopen(argv[i], "r"))) {
+      if ((input = open(argv[i], O_RDONLY)) < 0) {
         fprintf(stderr, "Can't open file '%s'\n", argv[i]);
         return 1;
       }
       inputs[i - 2] = input;
+      names[i - 2] = argv[i];
       num_in++;
     }
   }
 
   RE* re = RE_gen(regex);
-  char buf[BUFLEN];
   while (--num_in >= 0) {
-    while (fgets(buf, BUFLEN, inputs[num_in])) {
-      buf[strlen(buf) - 1] = '\0'; // get rid of newline at the end
-      if (RE_run(re, regex, buf)) {
-        printf("%s\n", buf);
-      }
-    }
-    fclose(inputs[num_in]);
+    if (grep_fd(re, regex, inputs[num_in], names[num_in]))
+      status = 1;
+    close(inputs[num_in]);
   }
   RE_destroy(re);
+  return status;
+}
+
+// Read all of 'fd' in blocks of READ_BLOCK bytes and print every line that
+// matches.
+// Line boundaries are found with memchr. A line which is cut off at the end of
+// a block is moved to the front of the buffer and completed by the next read,
+// growing the buffer if necessary, so there is no limit on the line length.
+int grep_fd(RE* re, const char* regex, int fd, const char* name)
+{
+  size_t cap = READ_BLOCK;
+  size_t len = 0;     // bytes of input currently in buf
+  size_t scanned = 0; // bytes at the start of buf known to contain no '\n'
+  char* buf = malloc(cap);
+  char* line;
+  char* nl;
+  ssize_t n;
+
+  for (;;) {
+    if (len == cap) { // a single line fills the whole buffer
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    n = read(fd, buf + len, cap - len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Can't read file '%s'\n", name);
+      free(buf);
+      return 1;
+    }
+    if (n == 0)
+      break;
+    len += n;
+
+    line = buf;
+    nl = memchr(buf + scanned, '\n', len - scanned);
+    while (nl != NULL) {
+      *nl = '\0'; // the matcher works on '\0' terminated strings
+      if (RE_run(re, regex, line))
+        printf("%s\n", line);
+      line = nl + 1;
+      nl = memchr(line, '\n', buf + len - line);
+    }
+
+    // keep the incomplete last line for the next read
+    len -= line - buf;
+    memmove(buf, line, len);
+    scanned = len;
+  }
+
+  // last line had no '\n', there is always space for the '\0' since the
+  // buffer is grown before it is full
+  if (len > 0) {
+    line = buf;
+    line[len] = '\0';
+    if (RE_run(re, regex, line))
+      printf("%s\n", line);
+  }
+  free(buf);
+  return 0;
 }
 
 
@@ -106,96 +183,74 @@ int char_match(char matcher, char source)
   return (matcher == '.' || matcher == source);
 }
 
+// Simulate the NFA on all of its states at once: 'curr' holds every state
+// the NFA can be in before text[0], each character moves all of them into
+// 'next' and the two are swapped. A state is in a set only once, however many
+// ways lead to it, so a line takes O(length * nodes) time and nothing is
+// allocated.
 int RE_run(RE* re, const char* regex, const char* text)
 {
-  cnl_field* cnl = insert_node_into_cnl(NULL, re->re_nfa->start, text);
-  cnl_field* tmp;
-  cnl_field* next;
-  nfa_node* curr_node;
-
-  // note that cnl can't be NULL at first iteration since there will always
-  // be at least one node in the NFA even for an empty regex
-  int end = 0;
-  do {
-    for (tmp = cnl; tmp != NULL; tmp = next) {
-      curr_node = tmp->node;
-      next = tmp->next; // store next node of cnl here so that even after
-                        // removing the current node we still progress with
-                        // the correct next node
-      
-
-      // only finish when we reach an end node AND
-      // if we need to match the end (because of $) the text is over
-      if (curr_node->isend && (!re->match_end || tmp->text[0] == '\0')) {
-        end = 1;
-        goto over;
-      }
-
-
-      // loop over all edges leading to next nodes
-      next_l_edge* iter;
-      for (iter = curr_node->next_l; iter != NULL; iter = iter->next) {
-        if (iter->always || (char_match(iter->cond_ch, tmp->text[0]))) {
-          if (iter->always)
-            cnl = insert_node_into_cnl(cnl, iter->node, tmp->text);
-          else if (tmp->text[0] != '\0')
-            cnl = insert_node_into_cnl(cnl, iter->node, tmp->text + 1);
-        }
+  sparse_set* curr = &re->curr;
+  sparse_set* next = &re->next;
+  sparse_set* tmp;
+  nfa_node* node;
+  next_l_edge* iter;
+
+  curr->count = 0;
+  add_closure(re, curr, re->re_nfa->start);
+  for (;; text++) {
+    // only finish when we reach an end node AND
+    // if we need to match the end (because of $) the text is over
+    if (!re->match_end || text[0] == '\0') {
+      for (int i = 0; i < curr->count; i++) {
+        if (re->nodes[curr->dense[i]]->isend)
+          return 1;
       }
-      
-      // as long as there is text left and we don't need to match the start
-      // (because of ^) we can keep this node and make it look at the next
-      // character
-      if (curr_node == re->re_nfa->start &&
-          !re->match_start &&
-          tmp->text[0] != '\0') {
-        tmp->text++;
-      } else {
-        cnl = remove_node_from_cnl(cnl, tmp);
+    }
+    if (text[0] == '\0')
+      return 0;
+
+    next->count = 0;
+    for (int i = 0; i < curr->count; i++) {
+      node = re->nodes[curr->dense[i]];
+      for (iter = node->next_l; iter != NULL; iter = iter->next) {
+        if (!iter->always && char_match(iter->cond_ch, text[0]))
+          add_closure(re, next, iter->node);
       }
     }
-  } while (!end && cnl != NULL);
-
-over:
-  free_cnl(cnl);
-  return end;
-}
-
-cnl_field* insert_node_into_cnl(
-    cnl_field* start, nfa_node* node_ptr, const char* text)
-{
-	cnl_field* ins = malloc(sizeof(cnl_field));
-	ins->node = node_ptr;
-	ins->next = start;
-  ins->text = text;
-  return ins;
+    // unless we need to match the start (because of ^) a match can also
+    // start at the next character
+    if (!re->match_start)
+      add_closure(re, next, re->re_nfa->start);
+    if (next->count == 0)
+      return 0;
+
+    tmp = curr;
+    curr = next;
+    next = tmp;
+  }
 }
 
-cnl_field* remove_node_from_cnl(cnl_field* start, cnl_field* rm_ptr)
+// Add the node and all nodes reachable from it over always edges to the set
+void add_closure(RE* re, sparse_set* set, nfa_node* node)
 {
-  if (start == NULL) {
-    return NULL;
-  }
-  cnl_field* iter;
-  cnl_field* next;
-  cnl_field* prev;
-  if (start == rm_ptr) {
-    next = start->next;
-    free(start);
-    return next;
-  }
-
-  prev = start;
-  for (iter = start->next; iter != NULL; iter = next) {
-    next = iter->next;
-    if (iter == rm_ptr) {
-      free(iter);
-      prev->next = next;
-    } else {
-      prev = iter;
+  int top = 0;
+  next_l_edge* iter;
+
+  if (sparse_set_has(set, node->id))
+    return;
+  sparse_set_add(set, node->id);
+  re->stack[top++] = node;
+  // every node is pushed at most once since it is added to the set first
+  while (top > 0) {
+    node = re->stack[--top];
+    for (iter = node->next_l; iter != NULL; iter = iter->next) {
+      if (iter->always && !sparse_set_has(set, iter->node->id)) {
+        sparse_set_add(set, iter->node->id);
+        re->stack[top++] = iter->node;
+      }
     }
   }
-  return start;
 }
 
 next_l_edge* insert_next_edge(next_l_edge* start, int always, char cond_ch, nfa_node* node)
@@ -291,15 +346,72 @@ RE* RE_gen(char* regex)
   }
 
   out->re_nfa = generate_nfa(regex);
+  out->nodes = number_nodes(out->re_nfa);
+  sparse_set_init(&out->curr, out->re_nfa->num_nodes);
+  sparse_set_init(&out->next, out->re_nfa->num_nodes);
+  out->stack = malloc(sizeof(nfa_node*) * out->re_nfa->num_nodes);
   return out;
 }
 
 void RE_destroy(RE* re)
 {
-  free_nfa(re->re_nfa);
+  free_nfa(re->re_nfa, re->nodes);
+  sparse_set_free(&re->curr);
+  sparse_set_free(&re->next);
+  free(re->stack);
   free(re);
 }
 
+// Give the nodes the ids 0 to num_nodes - 1 in the order in which they are
+// reached from the start node.
+// Returns the nodes by id.
+nfa_node** number_nodes(nfa* nfa_in)
+{
+  nfa_node** nodes = malloc(sizeof(nfa_node*) * nfa_in->num_nodes);
+  int num_found = 1;
+  next_l_edge* iter;
+
+  // the ids of nodes which have not been reached yet are not set, so the
+  // nodes found so far are looked up in 'nodes' itself
+  nodes[0] = nfa_in->start;
+  nodes[0]->id = 0;
+  for (int i = 0; i < num_found; i++) {
+    for (iter = nodes[i]->next_l; iter != NULL; iter = iter->next) {
+      if (!is_node_in_list(nodes, iter->node, num_found)) {
+        iter->node->id = num_found;
+        nodes[num_found++] = iter->node;
+      }
+    }
+  }
+  return nodes;
+}
+
+void sparse_set_init(sparse_set* set, int size)
+{
+  set->dense = malloc(sizeof(int) * size);
+  // any value would do, but valgrind doesn't know that
+  set->sparse = calloc(size, sizeof(int));
+  set->count = 0;
+}
+
+void sparse_set_free(sparse_set* set)
+{
+  free(set->dense);
+  free(set->sparse);
+}
+
+int sparse_set_has(sparse_set* set, int id)
+{
+  int pos = set->sparse[id];
+  return pos < set->count && set->dense[pos] == id;
+}
+
+void sparse_set_add(sparse_set* set, int id)
+{
+  set->sparse[id] = set->count;
+  set->dense[set->count++] = id;
+}
+
 int is_node_in_list(nfa_node** list, nfa_node* node, int list_size)
 {
   for (int i = 0; i < list_size; i++) {
@@ -309,37 +421,19 @@ int is_node_in_list(nfa_node** list, nfa_node* node, int list_size)
   return 0;
 }
 
-// deallocate memory for nfa
-void free_nfa(nfa* nfa)
+// deallocate memory for nfa, 'nodes' are its nodes by id
+void free_nfa(nfa* nfa, nfa_node** nodes)
 {
-  nfa_node** tofree = malloc(sizeof(nfa_node) * nfa->num_nodes);
-  tofree[0] = nfa->start;
-  int node_count = 1; // count how many nodes have been added to the array
-  int i;
   next_l_edge* tmp_edge;
   next_l_edge* next_edge;
-  for (i = 0; i < nfa->num_nodes; i++) {
-    for (tmp_edge = tofree[i]->next_l; tmp_edge != NULL; tmp_edge = next_edge) {
+  for (int i = 0; i < nfa->num_nodes; i++) {
+    for (tmp_edge = nodes[i]->next_l; tmp_edge != NULL; tmp_edge = next_edge) {
       next_edge = tmp_edge->next;
-      if (!is_node_in_list(tofree, tmp_edge->node, node_count))
-        tofree[node_count++] = tmp_edge->node;
       free(tmp_edge);
     }
-  }
-
-  for (i = 0; i < nfa->num_nodes; i++) {
-    free(tofree[i]);
+    free(nodes[i]);
   }
 
   free(nfa);
-  free(tofree);
-}
-
-void free_cnl(cnl_field* start)
-{
-  cnl_field* next;
-  for (; start != NULL; start = next) {
-    next = start->next;
-    free(start);
-  }
+  free(nodes);
 }
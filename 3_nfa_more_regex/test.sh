@@ -4,7 +4,7 @@ set -e
 
 make cgrep
 
-tests=('{' '.*' '^{' '^{$' '..;' ';$' '.*;$' 'edge. ' 'str(str)*')
+tests=('{' '.*' '^{' '^{$' '..;' ';$' '.*;$' 'edge. ' 'str(str)*' '(a*)*b' 'e.*r.*o')
 
 for regex in "${tests[@]}"; do
   echo "Testing: '$regex'"
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Compare the mmap and the read() input path on a generated log file and show
+# how searching it scales with the number of threads.
+# Usage: ./bench.sh [size in MB]
+
+set -e
+
+make -B cgrep CFLAGS="-O2"
+
+size_mb=${1:-256}
+corpus="bench_corpus.txt"
+regexes=('ERROR' 'time.*out$' '^2024' 'x')
+thread_regexes=('time.*out$' 'e.*r.*o')
+threads=(1 2 4 8 16)
+runs=3
+
+# deterministic log-like lines so that runs can be compared with each other
+awk -v size=$((size_mb * 1024 * 1024)) 'BEGIN {
+  srand(1);
+  split("INFO DEBUG WARN ERROR", level, " ");
+  split("connection request timeout worker cache disk user session", word, " ");
+  while (bytes < size) {
+    line = sprintf("2024-01-%02d %02d:%02d:%02d %s", int(rand() * 28) + 1,
+      int(rand() * 24), int(rand() * 60), int(rand() * 60),
+      level[int(rand() * 4) + 1]);
+    n = int(rand() * 12) + 2;
+    for (i = 0; i < n; i++)
+      line = line " " word[int(rand() * 8) + 1];
+    print line;
+    bytes += length(line) + 1;
+  }
+}' > "$corpus"
+
+# best wall clock time in seconds out of $runs runs of the given command
+best_time() {
+  local best=""
+  local t
+  for ((r = 0; r < runs; r++)); do
+    TIMEFORMAT=%R
+    t=$( { time "$@" > /dev/null; } 2>&1 )
+    if [[ -z "$best" ]] || awk "BEGIN { exit !($t < $best) }"; then
+      best=$t
+    fi
+  done
+  echo "$best"
+}
+
+printf "%-14s %-8s %10s %10s\n" "regex" "input" "seconds" "MB/s"
+for regex in "${regexes[@]}"; do
+  for mode in mmap read; do
+    if [[ $mode == mmap ]]; then
+      t=$(best_time ./cgrep -j1 "$regex" "$corpus")
+    else
+      t=$(best_time ./cgrep -j1 --no-mmap "$regex" "$corpus")
+    fi
+    printf "%-14s %-8s %10s %10.1f\n" "'$regex'" "$mode" "$t" \
+      "$(awk "BEGIN { print $size_mb / ($t > 0 ? $t : 0.001) }")"
+  done
+done
+
+echo
+printf "%-14s %-8s %10s %10s %8s\n" "regex" "threads" "seconds" "MB/s" "speedup"
+for regex in "${thread_regexes[@]}"; do
+  for j in "${threads[@]}"; do
+    t=$(best_time ./cgrep -j"$j" "$regex" "$corpus")
+    if [[ $j == 1 ]]; then
+      t1=$t
+    fi
+    printf "%-14s %-8s %10s %10.1f %8.2f\n" "'$regex'" "$j" "$t" \
+      "$(awk "BEGIN { print $size_mb / ($t > 0 ? $t : 0.001) }")" \
+      "$(awk "BEGIN { print $t1 / ($t > 0 ? $t : 0.001) }")"
+  done
+done
+
+rm "$corpus"
@@ -1,64 +1,162 @@
 /*
  * Implementation of these regular expressions:
- * - c for character c
+ * - c for character c, \c for c even if it is one of the characters below
  * - . for any character
- * - ^ for start of input
- * - $ for end of input
- * - * for 0 or more repetitions of previous character
+ * - [abc], [a-z], [^a-z] and [[:alpha:]] for any character of a class,
+ *   \w, \W, \s and \S for word and space characters and all others
+ * - ^ for start of line
+ * - $ for end of line
+ * - * for 0 or more repetitions of previous character or group
+ * - + for 1 or more and ? for 0 or 1 repetitions
+ * - {m}, {m,}, {,n} and {m,n} for m to n repetitions
+ * - | for either the regular expression left or right of it
  * - () for grouping regular expressions
  *
  * This is implemented using a non-deterministic finite automaton, i.e. a
  * non-deterministic finite state machine
  */
 
+#define _GNU_SOURCE // memrchr
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <x86intrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+#define REPEAT_MAX 1000 // larger counts of {m,n} are rejected, every
+                        // repetition is a copy in the NFA
+#define NFA_MAX_NODES (16 * 1024) // the closures take NFA_MAX_NODES^2 bits
+#define READ_BLOCK (256 * 1024) // bytes requested from read() at a time
+#define MMAP_MIN (64 * 1024)     // smaller files are cheaper to just read()
+#define OUTPUT_FLUSH (64 * 1024) // bytes a pipe holds, written at once
+#define OUTPUT_SLICES 1024 // slices written with one writev (IOV_MAX on Linux)
+#define CHUNK_MIN (4 * 1024 * 1024) // files are only split into chunks for
+                                    // several threads if they have at least
+                                    // two chunks of this size
+#define CHUNKS_PER_THREAD 4 // more chunks than threads even out the time
+                            // each thread takes
+#define DFA_DEAD 0    // state of the flattened DFA from which no end node
+                      // can be reached anymore
+#define DFA_UNKNOWN 1 // transition of a lazy DFA which is not computed yet
+#define DFA_FIRST 2   // id of the first real state
+#define DFA_CACHE (8 * 1024 * 1024) // default memory budget of the DFA
+#define DFA_EAGER_STATES 4096 // states nfa_to_dfa builds before the lazy
+                              // DFA takes over, about 5 ms
+#define DFA_EAGER_WORK (2 * 1024 * 1024) // words of sets nfa_to_dfa goes
+                                        // through before the lazy DFA takes
+                                        // over, about 5 ms as well
+#define DFA_CACHE_MAGIC "CGREPDFA" // start of every file of the DFA cache
+#define DFA_CACHE_VERSION 3 // changes whenever the format of the files or
+                            // the way the DFA is built changes
+#define HASH_INIT 14695981039346656037u // FNV-1a offset basis
+#define LITERAL_CHECK_SLACK 16 // false candidates of the literal which may
+                               // be compared before their bytes outweigh
+                               // the text and find_literal turns to memmem
+#define MINIMIZE_MIN 32 // DFAs with fewer states are not minimized by default,
+                        // 32 rows of the table already fill a 32 KiB L1 cache
+
+#define ARENA_CHUNK (64 * 1024) // size of the first chunk of an arena
+
+#define MODE_LINES 0         // print the matching lines
+#define MODE_COUNT 1         // -c, print the number of matching lines
+#define MODE_FILES 2         // -l, print the names of files with a match
+#define MODE_FILES_WITHOUT 3 // -L, print the names of files without one
+#define MODE_QUIET 4         // -q, only the exit status tells
+
+#define EXIT_MATCH 0    // a line matched, also with -L
+#define EXIT_NO_MATCH 1
+#define EXIT_TROUBLE 2  // an error, unless -q found a match
+
+// codes of the options without a short form
+#define OPT_NO_MMAP 256
+#define OPT_LAZY_DFA 257
+#define OPT_DFA_CACHE 258
+#define OPT_MINIMIZE 259
+#define OPT_NO_MINIMIZE 260
+#define OPT_DFA_STATS 261
+#define OPT_NO_PREFILTER 262
+#define OPT_INCLUDE 263
+#define OPT_EXCLUDE 264
+#define OPT_EXCLUDE_DIR 265
+#define OPT_CACHE_DIR 266
+#define OPT_STATS 267
+
+// what a thread of --stats spends its time on, see stats_phase
+#define PHASE_OTHER 0 // opening files, waiting for work, listing directories
+#define PHASE_READ 1  // read() and mmap
+#define PHASE_SCAN 2  // running the DFA or the scan kernels
+#define PHASE_WRITE 3 // writing matching lines
+#define NUM_PHASES 4
 
-#define BUFLEN 200
-#define MAXINPUTS 10
-
-#define IS_NODE_IN_ARRAY(OUT, ARR, NODE, SIZE) ({\
-  for (int i = 0; i < SIZE; i++) {\
-    if (ARR[i] == NODE)\
-      OUT = 1;\
-  }\
-  OUT = 0;\
-})
-
-#define FREE_FA_GRAPH(FIRST_NODE, TOFREE, ITER_EDGE, NEXT_EDGE, NUM_NODES) ({\
-  int node_count = 1;\
-  TOFREE[0] = FIRST_NODE;\
-  for (int i = 0; i < NUM_NODES; i++) {\
-    for (ITER_EDGE = TOFREE[i]->next_l; ITER_EDGE != NULL; ITER_EDGE = NEXT_EDGE) {\
-      int is_in_arr;\
-      IS_NODE_IN_ARRAY(is_in_arr, TOFREE, ITER_EDGE->node, node_count);\
-      if (!is_in_arr)\
-        TOFREE[node_count++] = ITER_EDGE->node;\
-      NEXT_EDGE = ITER_EDGE->next;\
-      free(ITER_EDGE);\
-    }\
-  }\
-  for (int i = 0; i < NUM_NODES; i++) {\
-    free(TOFREE[i]);\
-  }\
-})
+// Bytes of slices after which they are written: 0 on a terminal so every line
+// shows up at once, OUTPUT_FLUSH for pipes so the reader doesn't have to wait
+// for long and no limit for files, where slices are only written once there
+// are OUTPUT_SLICES of them or the input buffer is about to change.
+// Set by main before any thread starts.
+static size_t output_flush_bytes = SIZE_MAX;
+// one of the MODE_ constants and the number of matching lines after which the
+// rest of a file is not needed anymore, both set by main as well
+static int output_mode = MODE_LINES;
+static size_t output_max_count = SIZE_MAX;
+// --stats counters of the calling thread, NULL without --stats and for
+// threads which don't search
+static __thread struct thread_stats* cur_stats = NULL;
 
+// Memory which is handed out in order from a list of chunks, each twice as
+// large as the one before, and can only be given back all at once. All nodes
+// and edges of the automatons are allocated from arenas so that compiling a
+// regex doesn't take a malloc per node and freeing it doesn't need a walk over
+// the graph.
+typedef struct arena_chunk {
+  struct arena_chunk* next; // the chunk allocated before this one
+  size_t size;
+  max_align_t data[];
+} arena_chunk;
+
+typedef struct arena {
+  arena_chunk* chunks; // newest chunk first
+  size_t used;         // bytes used of the newest chunk
+} arena;
+
+// An edge is taken on any byte of its set, so a class like [a-z0-9] is one
+// edge. Always edges have no set and are taken without reading a byte, those
+// of anchors only at the start ('^') or the end ('$') of the line.
 typedef struct nfa_edge {
-  char cond_ch;
-  int always;
+  const uint64_t* bytes; // set of 256 bits, NULL for always edges
+  int anchor;            // '^', '$' or 0
   struct nfa_node* node;
   struct nfa_edge* next;
 } nfa_edge;
 
 typedef struct dfa_edge {
-  char cond_ch;
+  int cls; // class of the bytes the edge is taken on, see new_dfa_table
   struct dfa_node* node;
   struct dfa_edge* next;
 } dfa_edge;
 
 
 typedef struct nfa_node {
+  int id;
   int isend;
   struct nfa_edge* next_l;
 } nfa_node;
@@ -67,558 +165,4290 @@ typedef struct nfa {
   int num_nodes;
   struct nfa_node* start;
   struct nfa_node* end;
+  // filled in by nfa_closures once the NFA is complete
+  nfa_node** nodes;    // nodes by id
+  int set_words;       // 64 bit words of a set of NFA nodes
+  uint64_t* closures;  // set of nodes reachable over always edges from node
+                       // id, including the node itself, at id * set_words
+  uint64_t* start_set; // closure of the start node, also over '^' edges
+  uint64_t* ends;      // set of all end nodes
+  uint64_t* eol_ends;  // set of nodes from which an end node can be reached
+                       // at the end of a line, i.e. also over '$' edges
+  int has_eol;         // 1 if there is a '$' edge
+  int empty_line;      // 1 if an empty line matches, where '^' and '$' edges
+                       // can both be taken, e.g. for $^
 } nfa;
 
+// Where generate_nfa is in the regular expression
+typedef struct regex_parser {
+  const char* p;
+  int depth;          // of the groups around p
+  int* next_id;
+  arena* mem;
+  uint64_t* any;      // set of '.'
+  int has_eol;        // 1 once a '$' has been seen
+  const char* error;  // NULL unless the regular expression is invalid
+} regex_parser;
+
 
 typedef struct dfa_node {
-  int isend;
+  int id;
+  int isend;  // contains an end node
+  int iseol;  // contains a node of eol_ends
   struct dfa_edge* next_l;
 } dfa_node;
 
 typedef struct dfa {
   int num_nodes;
+  int num_edges;
   struct dfa_node* start;
 } dfa;
 
+// DFA flattened into one table with a row of next states for each state and
+// a column for each class of bytes which the regex doesn't tell apart
+typedef struct dfa_table {
+  int num_states;      // including DFA_DEAD and DFA_UNKNOWN
+  uint32_t start;
+  uint32_t line_match; // start of a line after a line matched by $
+  int num_classes;
+  int shift;           // rows have 1 << shift columns, at least num_classes
+  uint8_t classes[256]; // class of each byte
+  uint32_t* trans;     // next state for byte c in state s is
+                       // trans[(s << shift) + classes[c]]
+  uint8_t* accept;     // 1 for states which came from an end node, the line
+                       // matches whatever follows
+  uint8_t* accept_eol; // 1 for states in which the line matches if it ends
+                       // there, because of $ or since they accept anyway
+  uint8_t* stop;       // 1 for states at which the buffer scan has to stop
+  struct lazy_dfa* lazy; // NULL if all states have been built up front
+  void* map;           // file of the DFA cache the arrays are in, or NULL
+  size_t map_len;
+} dfa_table;
+
+// Start of a file of the DFA cache, see dfa_cache_store
+typedef struct dfa_cache_header {
+  char magic[8];         // DFA_CACHE_MAGIC without its '\0'
+  uint32_t version;      // DFA_CACHE_VERSION
+  uint32_t num_states;
+  uint32_t num_classes;
+  uint32_t shift;
+  uint32_t start;
+  uint32_t line_match;
+  uint64_t key_len;
+  uint64_t checksum;     // dfa_cache_checksum of the whole file
+  uint8_t classes[256];
+} dfa_cache_header;
+
+// Node of the Aho-Corasick trie of the -F patterns. The nodes are numbered
+// breadth first, so the children of a node follow each other, sorted by byte.
+typedef struct ac_node {
+  uint32_t child;        // id of the first child
+  uint32_t fail;         // node of the longest proper suffix in the trie
+  uint16_t num_children;
+  unsigned char c;       // byte on the edge from the parent
+  uint8_t isend;         // a pattern ends here or at a suffix of it
+} ac_node;
+
+// All -F patterns in one trie, node 0 is the root. Once a node matches, the
+// line does so no matter what follows, so the children of end nodes are left
+// out: a pattern which contains another one can't change the result.
+typedef struct ac_trie {
+  ac_node* nodes;
+  uint32_t num_nodes;
+  uint32_t* order;   // the nodes which are left, breadth first
+  uint32_t num_order;
+  int num_patterns;
+} ac_trie;
+
+// State of a DFA which is built while the input is scanned. Each state stands
+// for a set of NFA nodes, its row in the table starts out with all
+// transitions set to DFA_UNKNOWN.
+typedef struct lazy_dfa {
+  struct nfa* nfa_in;
+  struct ac_trie* trie; // for -F instead of nfa_in, each state is then one
+                        // node of the trie instead of a set
+  int words;          // 64 bit words of the set of each state
+  int match_end;
+  size_t budget;      // bytes the states may use before the cache is flushed
+  size_t used;
+  int max_states;     // allocated rows of the table
+  uint64_t* sets;     // set of NFA nodes of state s at s * words
+  int* buckets;       // hash table of the states by their set
+  int* hash_next;
+  int num_buckets;
+  uint64_t* scratch;  // set being built
+  int flushes;
+} lazy_dfa;
+
+
+// Wall clock and CPU time in seconds
+typedef struct stats_time {
+  double wall;
+  double cpu; // of the thread, or of the process for the whole run
+} stats_time;
+
+// Counters of --stats of one thread. Each thread has its own so they are
+// updated without any locks.
+typedef struct thread_stats {
+  int used;           // 1 once a thread counted into it
+  stats_time phases[NUM_PHASES]; // time in each PHASE_
+  int phase;          // the PHASE_ the thread is in
+  stats_time since;   // when it entered it
+  size_t files;
+  size_t bytes;       // scanned by the thread
+  size_t lines;
+  size_t matches;     // matching lines found by the thread
+  size_t lazy_states; // states of its lazy DFA, summed over its copies
+  int lazy_flushes;
+  struct thread_stats* helpers; // counters of the threads which search the
+                                // chunks of this thread's files
+} thread_stats;
+
+// Everything --stats prints, see print_stats
+typedef struct run_stats {
+  stats_time compile;
+  const char* automaton; // how the regex is searched for
+  int nfa_nodes;         // 0 if there is no NFA
+  int dfa_states;        // from nfa_to_dfa or of the trie, 0 if lazy
+  int dfa_edges;
+  int min_states;        // after dfa_minimize, 0 if not minimized
+  int num_classes;
+  thread_stats* threads; // one for each of the -j threads
+  int num_threads;
+} run_stats;
+
+typedef struct grep_opts {
+  int use_mmap;
+  int lazy;         // always build the DFA lazily
+  size_t dfa_cache; // memory budget of the DFA in bytes
+  int minimize;     // 1 always, 0 never, -1 from MINIMIZE_MIN states on
+  int dfa_stats;    // print the number of DFA states to stderr
+  int prefilter;    // look for the required literal before running the DFA
+  int threads;      // number of threads searching the files
+  int recursive;    // search the files in directories, skipping binary ones
+  char** includes;  // globs of the names of files which -r searches,
+  int num_includes; // all if there are none
+  char** excludes;  // globs of the names of files which -r skips
+  int num_excludes;
+  char** exclude_dirs;
+  int num_exclude_dirs;
+  long max_count;   // -m, -1 if there is no limit
+  int fixed;        // -F, the patterns are strings and not regexes
+  char* patterns;   // -F or -f, each pattern followed by a '\n'
+  size_t patterns_len;
+  const char* cache_dir; // directory of the DFA cache, NULL for none
+  run_stats* stats; // --stats, NULL without it
+} grep_opts;
+
+// Output of one input file or of a chunk of one. It is copied into 'buf' and
+// only written once the output of all files before it has been written, so it
+// comes out in the order of the arguments however the files are spread over
+// the threads. Once it is next, lines are not copied anymore but collected as
+// slices of the input buffer which are written with writev.
+typedef struct output {
+  char* buf;
+  size_t len;
+  size_t cap;
+  const char* prefix; // file name printed in front of every line, or NULL
+  size_t prefix_len;
+  int index;          // position of the file in the arguments
+  int* next_out;      // index of the first file whose output isn't written
+  struct output* parent; // output of the whole file for chunks, else NULL
+  size_t count;          // matching lines
+  int stop;              // 1 once no more lines are needed from the file
+  int direct;            // 1 once output_direct found that it is next
+  struct iovec* slices;  // OUTPUT_SLICES slices, only valid as long as the
+  int num_slices;        // input buffer they point into
+  size_t slice_bytes;
+} output;
+
+// Outputs which are written in the order of their index, whichever thread
+// fills them
+typedef struct output_order {
+  output* outputs;
+  uint8_t* done;   // 1 once all lines are in the output
+  int count;
+  int next_out;
+  pthread_mutex_t lock;
+} output_order;
+
+// A file to search or, with -r, a directory to list
+typedef struct work_item {
+  char* path;  // owned by the item unless it is one of the arguments
+  int index;   // position in the arguments, -1 if found in a directory
+  int is_dir;
+} work_item;
+
+// Items which one thread still has to work on, kept in a ring buffer. The
+// thread takes them from the front and puts what it finds in directories
+// there as well, threads which have run out of items steal from the back.
+typedef struct work_queue {
+  work_item* items;
+  int cap;
+  int head;
+  int count;
+  pthread_mutex_t lock;
+} work_queue;
+
+typedef struct worker {
+  struct search* s;
+  int id;
+  pthread_t thread;
+  int started;
+  work_queue queue;
+  int status;  // 1 if there was an error
+  int matched; // 1 if a line matched
+} worker;
+
+// Everything the threads share while searching the files
+typedef struct search {
+  struct RE* re;   // only read, see search_worker
+  grep_opts* opts;
+  int num_files;
+  int show_names;  // print the file name in front of every line
+  output_order order; // one output per argument, unused with -r
+  pthread_mutex_t write_lock; // with -r files are written when they are done
+  worker* workers;
+  int num_workers;
+  int chunk_threads;  // threads which search the chunks of one file
+  int pending;     // items in the queues or being worked on
+  int pushes;      // number of times items were added to the queues
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond; // signaled when items are added or none are left
+} search;
+
+// Chunks of one file which are searched by several threads, each of them
+// starts and ends at a line boundary
+typedef struct chunk_search {
+  struct RE* re;
+  const char* map;
+  size_t* bounds; // chunk i goes from map + bounds[i] to map + bounds[i + 1]
+  int num_chunks;
+  int next_chunk; // first chunk which no thread has taken yet
+  int stop;       // 1 once a chunk has found all lines the file needs
+  output_order order; // one output per chunk
+  thread_stats* helper_stats; // --stats of the threads started for the
+  int next_helper;            // chunks, NULL without it
+} chunk_search;
+
+// Functions which search a buffer for bytes, there is one set for each
+// instruction set in scan_kernel_list
+typedef struct scan_kernels {
+  const char* name;
+  const char* (*find_byte)(const char* p, const char* end, unsigned char c);
+  const char* (*find_pair)(const char* p, const char* end, unsigned char c0,
+      unsigned char c1, size_t dist);
+} scan_kernels;
 
 typedef struct RE {
   int match_start;
   int match_end;
-  struct dfa* dfa;
+  char* literal;      // string which every matching line contains
+  size_t literal_len; // 0 if there is none
+  int is_literal;     // the regex is just the literal, there is no DFA
+  size_t rare0;       // offsets of the two rarest bytes of the literal,
+  size_t rare1;       // which the kernels look for
+  const scan_kernels* scan;
+  struct dfa_table* table; // NULL for literals
+  arena mem; // NFA and lazy DFA state, everything but the table itself
 } RE;
 
-typedef struct nfal {
-  nfa_node* node;
-  struct nfal* next;
-} nfal;
 
+// DFA node during the conversion together with the set of NFA nodes it
+// stands for
 typedef struct dfagen_node {
-  nfal* nfas;
+  uint64_t* set;
+  uint32_t hash;
   dfa_node* node;
-  struct dfagen_node* next;
+  struct dfagen_node* next;      // next node of the worklist
+  struct dfagen_node* hash_next; // next node in the same hash bucket
 } dfagen_node;
 
-typedef struct always_g {
-  int isend;
-  nfal* nfas;
-} always_g;
+// hash table of all dfagen_nodes created by nfa_to_dfa
+typedef struct dfagen_set {
+  dfagen_node** buckets;
+  int num_buckets;
+  int count;
+} dfagen_set;
 
-typedef struct nfa_2dlist {
-  char cond_ch;
-  int isend;
-  nfal* nfas;
-  struct nfa_2dlist* next; 
-} nfa_2dlist;
 
 
-int char_match(char matcher, char source);
-int RE_run(RE* re, const char* regex, const char* text);
-int RE_matchhere(RE* re, const char* regex, const char* text);
-RE* RE_gen(char* regex);
+int RE_run(RE* re, const char* text, size_t len);
+RE* RE_gen(const char* regex, grep_opts* opts);
+RE* RE_gen_fixed(const char* patterns, size_t len, grep_opts* opts);
+int read_patterns(grep_opts* opts, const char* name);
 void RE_destroy(RE* re);
-nfa_edge* insert_nfa_edge(nfa_edge* start, int always, char cond_ch, nfa_node* node);
-dfa_edge* insert_dfa_edge(dfa_edge* start, char cond_ch, dfa_node* node);
-nfa* generate_nfa(const char* regex);
-void free_nfa(nfa* nfa_init);
-int is_node_in_list(nfa_node** list, nfa_node* node, int list_size);
+RE* RE_thread_copy(RE* re);
+nfa_node* new_nfa_node(int* next_id, arena* mem);
+nfa_edge* insert_nfa_edge(nfa_edge* start, const uint64_t* bytes, int anchor, nfa_node* node, arena* mem);
+dfa_edge* insert_dfa_edge(dfa_edge* start, int cls, dfa_node* node, arena* mem);
+nfa* generate_nfa(const char* regex, int* next_id, arena* mem);
+nfa* parse_alt(regex_parser* rp);
+nfa* parse_concat(regex_parser* rp);
+nfa* parse_repeat(regex_parser* rp);
+nfa* parse_atom(regex_parser* rp);
+const char* parse_class(const char** p, uint64_t* bytes);
+int parse_escape(char c, uint64_t* bytes);
+size_t parse_bound(const char* p, int* min, int* max);
+nfa* nfa_fragment(regex_parser* rp, const uint64_t* bytes, int anchor);
+nfa* nfa_concat(regex_parser* rp, nfa* first, nfa* second);
+nfa* nfa_alt(regex_parser* rp, nfa* first, nfa* second);
+nfa* nfa_repeat(regex_parser* rp, nfa* unit, int first_id, int min, int max);
+nfa* nfa_copy(regex_parser* rp, nfa* unit, int first_id, int past_id);
+int nfa_anchored(nfa* nfa_in);
+int is_literal_regex(const char* regex, size_t len);
+int literal_lines(const char* patterns, size_t len);
+void add_search_loop(nfa* nfa_in, arena* mem);
+void nfa_closures(nfa* nfa_in, arena* mem);
+
+dfa* nfa_to_dfa(nfa* nfa_in, dfa_table* table, int max_nodes, arena* mem);
+dfa_table* new_dfa_table(nfa* nfa_in);
+void dfa_flatten(dfa_table* table, dfa* dfa_in, arena* scratch);
+void dfa_minimize(dfa_table* table, arena* scratch);
+void dfa_add_newlines(dfa_table* table, int match_end);
+size_t required_literal(const char* regex, char* out);
+
+void lazy_dfa_new(dfa_table* table, nfa* nfa_in, ac_trie* trie, int match_end, size_t budget, arena* mem);
+uint32_t lazy_dfa_next(dfa_table* table, uint32_t state, unsigned char c);
+uint32_t lazy_dfa_add_state(dfa_table* table, const uint64_t* set, int hashed);
+void lazy_dfa_flush(dfa_table* table);
+
+ac_trie* ac_build(const char* patterns, size_t len, arena* mem);
+int ac_pattern_cmp(const void* a, const void* b);
+uint32_t ac_child(ac_trie* trie, uint32_t node, unsigned char c);
+uint32_t ac_next(ac_trie* trie, uint32_t node, unsigned char c);
+dfa_table* ac_new_table(const char* patterns, size_t len);
+void ac_flatten(dfa_table* table, ac_trie* trie, arena* scratch);
 
-dfa* nfa_to_dfa(nfa* nfa_in);
-dfagen_node* insert_into_dfagen_list(dfagen_node* worklist, int isend, nfal* alw_g);
-dfagen_node* find_dfagen_node(dfagen_node* list, nfal* nfas);
-dfagen_node* insert_node_into_dfagen_list(dfagen_node* worked_list, dfagen_node* item);
+char* dfa_cache_key(const char* pattern, size_t pattern_len, int fixed,
+    int minimize, size_t* len);
+char* dfa_cache_path(const char* dir, const char* key, size_t key_len);
+dfa_table* dfa_cache_load(const char* dir, const char* key, size_t key_len,
+    size_t budget);
+void dfa_cache_store(const char* dir, const char* key, size_t key_len,
+    const dfa_table* table);
+uint64_t dfa_cache_checksum(const dfa_cache_header* header,
+    const uint32_t* trans, size_t trans_len, const uint8_t* flags,
+    size_t flags_len, const char* key, size_t key_len);
+int dfa_cache_table_valid(const dfa_cache_header* header, const uint32_t* trans);
+dfagen_node* insert_into_dfagen_set(dfagen_set* set, nfa* nfa_in, const uint64_t* bits, uint32_t hash, arena* mem);
+dfagen_node* find_dfagen_node(dfagen_set* set, const uint64_t* bits, int words, uint32_t hash);
 
-always_g* always_group(nfa_node* node);
-nfal* insert_into_nfa_list(nfal* list, nfa_node* node);
-nfal* union_into_nfa_list(nfal* a, nfal* b);
-nfal* copy_nfa_list(nfal* list);
-int contains_nfa_list(nfal* list, nfa_node* node);
+void set_union(uint64_t* a, const uint64_t* b, int words);
+int set_intersects(const uint64_t* a, const uint64_t* b, int words);
+int set_is_empty(const uint64_t* a, int words);
+int set_has(const uint64_t* a, int bit);
+void set_add(uint64_t* a, int bit);
+uint32_t hash_set(const uint64_t* a, int words);
+uint64_t hash_bytes(uint64_t h, const void* data, size_t len);
 
+void* arena_alloc(arena* a, size_t size);
+void* arena_calloc(arena* a, size_t count, size_t size);
+void arena_reset(arena* a);
+void arena_free(arena* a);
 
-nfa_2dlist* insert_into_conns(nfa_2dlist* conns, char cond_ch, int isend, nfal* nfas);
+void free_dfa_table(dfa_table* table);
 
-void free_nfa_list(nfal* nfa_list);
-void free_nfa_2dlist(nfa_2dlist* list);
-void free_dfagen_list(dfagen_node* list);
-void free_dfa(dfa* dfa);
-void free_always_group(always_g* alw_g);
+int grep_files(RE* re, grep_opts* opts, char** names, int num_files);
+void* search_worker(void* arg);
+void search_item(worker* w, RE* re, work_item* item);
+void walk_dir(worker* w, const char* path);
+int walk_skip(grep_opts* opts, const char* name, int is_dir);
+int next_item(worker* w, work_item* item);
+void push_items(worker* w, work_item* items, int n);
+void queue_push_front(work_queue* q, work_item item);
+void output_order_init(output_order* order, int count, output* parent);
+void output_order_free(output_order* order);
+void output_finish(output_order* order, int index);
+void output_flush(output* out);
+void output_write_slices(output* out);
+void output_free(output* out);
+int output_is_next(output* out);
+int output_direct(output* out);
+void output_slice(output* out, const char* data, size_t len);
+int write_all(int fd, struct iovec* iov, int n);
+void output_reserve(output* out, size_t len);
+int grep_file(RE* re, grep_opts* opts, int fd, const char* name, int threads,
+    output* out);
+void grep_chunks(RE* re, const char* map, size_t len, int threads, output* out);
+void* chunk_worker(void* arg);
+int grep_fd(RE* re, int fd, const char* name, int skip_binary, output* out);
+int is_binary(const char* buf, size_t len);
+size_t grep_lines(RE* re, const char* buf, size_t len, output* out);
+void grep_candidates(RE* re, const char* buf, const char* end, output* out);
+void grep_literal(RE* re, const char* buf, const char* end, output* out);
+int literal_run(RE* re, const char* text, size_t len);
+void print_line(output* out, const char* line, size_t len);
+void count_line(output* out);
+void output_summary(output* out, const char* name);
+void print_last_line(output* out, const char* line, size_t len);
+void output_line(output* out, const char* line, size_t len, const char* newline);
 
+stats_time stats_now(void);
+void stats_thread_start(thread_stats* stats);
+void stats_thread_end(void);
+int stats_phase(int phase);
+void stats_scanned(const char* buf, size_t len, size_t matches);
+void stats_lazy(RE* re);
+void print_stats(run_stats* stats, stats_time start);
 
+const scan_kernels* select_scan_kernels(void);
+const char* find_literal(RE* re, const char* p, const char* end);
+int byte_rarity(unsigned char c);
+void choose_rare_pair(RE* re);
+const char* find_byte_scalar(const char* p, const char* end, unsigned char c);
+const char* find_pair_scalar(const char* p, const char* end, unsigned char c0, unsigned char c1, size_t dist);
+#if SCAN_X86
+const char* find_byte_sse2(const char* p, const char* end, unsigned char c);
+const char* find_pair_sse2(const char* p, const char* end, unsigned char c0, unsigned char c1, size_t dist);
+const char* find_byte_avx2(const char* p, const char* end, unsigned char c);
+const char* find_pair_avx2(const char* p, const char* end, unsigned char c0, unsigned char c1, size_t dist);
+#endif
+#ifdef KERNEL_BENCH
+int kernel_bench(void);
+#endif
 
-int main(int argc, const char* argv[])
+
+int main(int argc, char* argv[])
 {
-  FILE* inputs[MAXINPUTS] = {stdin};
-  FILE* input;
-  int num_in = 1;
-  char regex[BUFLEN];
-  if (argc < 2) {
+  int status;
+  int list = 0;  // MODE_FILES or MODE_FILES_WITHOUT for the last of -l and -L
+  int count = 0;
+  int quiet = 0;
+  grep_opts opts = {.use_mmap = 1, .lazy = 0, .dfa_cache = DFA_CACHE,
+    .minimize = -1, .dfa_stats = 0, .prefilter = 1,
+    .threads = sysconf(_SC_NPROCESSORS_ONLN), .recursive = 0,
+    .num_includes = 0, .num_excludes = 0, .num_exclude_dirs = 0,
+    .max_count = -1, .fixed = 0, .patterns = NULL, .patterns_len = 0,
+    .cache_dir = NULL, .stats = NULL};
+  static const struct option long_opts[] = {
+    {"no-mmap", no_argument, NULL, OPT_NO_MMAP},
+    {"lazy-dfa", no_argument, NULL, OPT_LAZY_DFA},
+    {"dfa-cache", required_argument, NULL, OPT_DFA_CACHE},
+    {"minimize", no_argument, NULL, OPT_MINIMIZE},
+    {"no-minimize", no_argument, NULL, OPT_NO_MINIMIZE},
+    {"dfa-stats", no_argument, NULL, OPT_DFA_STATS},
+    {"no-prefilter", no_argument, NULL, OPT_NO_PREFILTER},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"exclude", required_argument, NULL, OPT_EXCLUDE},
+    {"exclude-dir", required_argument, NULL, OPT_EXCLUDE_DIR},
+    {"cache-dir", required_argument, NULL, OPT_CACHE_DIR},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+  char* num_end;
+  struct stat out_st;
+  char** files;
+  int num_files;
+  RE* re;
+  run_stats stats = {.automaton = "DFA", .nfa_nodes = 0, .dfa_states = 0,
+    .dfa_edges = 0, .min_states = 0, .num_classes = 0};
+  stats_time start = stats_now();
+
+#ifdef KERNEL_BENCH
+  return kernel_bench();
+#endif
+  if (opts.threads < 1)
+    opts.threads = 1;
+  // every option can be given at most once per argument
+  opts.includes = malloc(sizeof(char*) * argc);
+  opts.excludes = malloc(sizeof(char*) * argc);
+  opts.exclude_dirs = malloc(sizeof(char*) * argc);
+  while ((opt = getopt_long(argc, argv, "j:rclLqm:Ff:", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      opts.threads = strtol(optarg, &num_end, 10);
+      if (*num_end != '\0' || opts.threads < 1) {
+        fprintf(stderr, "Invalid number of threads '%s'\n", optarg);
+        return EXIT_TROUBLE;
+      }
+      break;
+    case 'c':
+      count = 1;
+      break;
+    case 'l':
+      list = MODE_FILES;
+      break;
+    case 'L':
+      list = MODE_FILES_WITHOUT;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 'm':
+      opts.max_count = strtol(optarg, &num_end, 10);
+      if (*num_end != '\0' || opts.max_count < 0) {
+        fprintf(stderr, "Invalid maximum number of matches '%s'\n", optarg);
+        return EXIT_TROUBLE;
+      }
+      break;
+    case 'F':
+      opts.fixed = 1;
+      break;
+    case 'f':
+      if (read_patterns(&opts, optarg))
+        return EXIT_TROUBLE;
+      break;
+    case OPT_NO_MMAP:
+      opts.use_mmap = 0;
+      break;
+    case OPT_LAZY_DFA:
+      opts.lazy = 1;
+      break;
+    case OPT_DFA_CACHE:
+      opts.dfa_cache = strtoul(optarg, &num_end, 10) * 1024;
+      if (*num_end != '\0' || opts.dfa_cache == 0) {
+        fprintf(stderr, "Invalid DFA cache size '%s' (in KiB)\n", optarg);
+        return EXIT_TROUBLE;
+      }
+      break;
+    case OPT_MINIMIZE:
+      opts.minimize = 1;
+      break;
+    case OPT_NO_MINIMIZE:
+      opts.minimize = 0;
+      break;
+    case OPT_DFA_STATS:
+      opts.dfa_stats = 1;
+      break;
+    case OPT_NO_PREFILTER:
+      opts.prefilter = 0;
+      break;
+    case 'r':
+      opts.recursive = 1;
+      break;
+    case OPT_INCLUDE:
+      opts.includes[opts.num_includes++] = optarg;
+      break;
+    case OPT_EXCLUDE:
+      opts.excludes[opts.num_excludes++] = optarg;
+      break;
+    case OPT_EXCLUDE_DIR:
+      opts.exclude_dirs[opts.num_exclude_dirs++] = optarg;
+      break;
+    case OPT_CACHE_DIR:
+      opts.cache_dir = optarg;
+      mkdir(optarg, 0777); // if it exists already it is just used
+      break;
+    case OPT_STATS:
+      opts.stats = &stats;
+      break;
+    default:
+      return EXIT_TROUBLE;
+    }
+  }
+  files = argv + optind;
+  num_files = argc - optind;
+  if (opts.patterns == NULL && num_files < 1) {
     fprintf(stderr, "Need at least a regular expression\n");
-    return 1;
+    return EXIT_TROUBLE;
   }
-  strncpy(regex, argv[1], BUFLEN);
-  regex[BUFLEN-1] = '\0'; // in case the length was longer than BUFLEN we need
-                          // to add a '\0' termination byte
-  if (argc >= 3) {
-    num_in = 0;
-    for (int i = 2; i < argc; i++) {
-      if (!(input = fopen(argv[i], "r"))) {
-        fprintf(stderr, "Can't open file '%s'\n", argv[i]);
-        return 1;
-      }
-      inputs[i - 2] = input;
-      num_in++;
+
+  // -q needs nothing but the first match, -l and -L the first of each file
+  if (quiet)
+    output_mode = MODE_QUIET;
+  else if (list)
+    output_mode = list;
+  else if (count)
+    output_mode = MODE_COUNT;
+  if (output_mode == MODE_QUIET || list)
+    output_max_count = 1;
+  if (opts.max_count >= 0 && (size_t)opts.max_count < output_max_count)
+    output_max_count = opts.max_count;
+  // like grep, -m 0 doesn't even open the files unless -L lists them
+  if (output_max_count == 0 && output_mode != MODE_FILES_WITHOUT) {
+    free(opts.patterns);
+    free(opts.includes);
+    free(opts.excludes);
+    free(opts.exclude_dirs);
+    return EXIT_NO_MATCH;
+  }
+  if (isatty(STDOUT_FILENO))
+    output_flush_bytes = 0;
+  else if (fstat(STDOUT_FILENO, &out_st) == 0 && S_ISFIFO(out_st.st_mode))
+    output_flush_bytes = OUTPUT_FLUSH;
+
+  if (opts.stats != NULL) {
+    stats.num_threads = opts.threads;
+    stats.threads = calloc(opts.threads, sizeof(thread_stats));
+    stats.compile = stats_now();
+  }
+  // -f lines without any special characters need no NFA, however many there are
+  if (opts.fixed || (opts.patterns != NULL &&
+        literal_lines(opts.patterns, opts.patterns_len))) {
+    if (opts.patterns == NULL) { // like grep, each line is a pattern of its own
+      opts.patterns_len = strlen(files[0]) + 1;
+      opts.patterns = malloc(opts.patterns_len);
+      memcpy(opts.patterns, files[0], opts.patterns_len - 1);
+      opts.patterns[opts.patterns_len - 1] = '\n';
+      files++;
+      num_files--;
     }
+    re = RE_gen_fixed(opts.patterns, opts.patterns_len, &opts);
+  } else if (opts.patterns != NULL) {
+    // the lines of -f are alternatives of one regular expression
+    opts.patterns[opts.patterns_len - 1] = '\0';
+    re = RE_gen(opts.patterns, &opts);
+  } else {
+    re = RE_gen(files[0], &opts);
+    files++;
+    num_files--;
+  }
+  if (opts.stats != NULL) {
+    stats_time now = stats_now();
+    stats.compile.wall = now.wall - stats.compile.wall;
+    stats.compile.cpu = now.cpu - stats.compile.cpu;
+  }
+  if (re == NULL) {
+    free(stats.threads);
+    free(opts.patterns);
+    free(opts.includes);
+    free(opts.excludes);
+    free(opts.exclude_dirs);
+    return EXIT_TROUBLE;
   }
 
-  RE* re = RE_gen(regex);
-  char buf[BUFLEN];
-  while (--num_in >= 0) {
-    while (fgets(buf, BUFLEN, inputs[num_in])) {
-      buf[strlen(buf) - 1] = '\0'; // get rid of newline at the end
-      if (RE_run(re, regex, buf)) {
-        printf("%s\n", buf);
-      }
+  if (num_files == 0 && opts.recursive) {
+    char* cwd[] = {""}; // the current directory without "./" in front
+    status = grep_files(re, &opts, cwd, 1);
+  } else if (num_files == 0) {
+    int next_out = 0;
+    output out = {.next_out = &next_out};
+    if (opts.stats != NULL) {
+      stats_thread_start(&stats.threads[0]);
+      stats.threads[0].helpers = stats.threads + 1;
+    }
+    status = grep_file(re, &opts, STDIN_FILENO, "(standard input)",
+        opts.threads, &out) ? EXIT_TROUBLE : EXIT_NO_MATCH;
+    output_summary(&out, "(standard input)");
+    output_flush(&out);
+    if (status != EXIT_TROUBLE && out.count > 0)
+      status = EXIT_MATCH;
+    if (cur_stats != NULL) {
+      cur_stats->files++;
+      stats_lazy(re);
+      stats_thread_end();
     }
-    fclose(inputs[num_in]);
+    output_free(&out);
+  } else {
+    status = grep_files(re, &opts, files, num_files);
   }
+  if (opts.stats != NULL)
+    print_stats(&stats, start);
+  free(stats.threads);
   RE_destroy(re);
+  free(opts.patterns);
+  free(opts.includes);
+  free(opts.excludes);
+  free(opts.exclude_dirs);
+  return status;
 }
 
-
-int char_match(char matcher, char source)
+// Append the lines of the file to the -f patterns, "-" is standard input.
+// Every pattern ends with a '\n', also the last one of a file without it.
+// Returns 1 if the file can't be read.
+int read_patterns(grep_opts* opts, const char* name)
 {
-  return (matcher == '.' || matcher == source);
+  int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+  size_t start = opts->patterns_len;
+  size_t cap = start + READ_BLOCK;
+  ssize_t n = 0;
+
+  if (fd < 0) {
+    fprintf(stderr, "Can't open file '%s'\n", name);
+    return 1;
+  }
+  opts->patterns = realloc(opts->patterns, cap);
+  while ((n = read(fd, opts->patterns + opts->patterns_len,
+          cap - opts->patterns_len - 1)) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    opts->patterns_len += n;
+    if (cap - opts->patterns_len == 1) {
+      cap *= 2;
+      opts->patterns = realloc(opts->patterns, cap);
+    }
+  }
+  if (fd != STDIN_FILENO)
+    close(fd);
+  if (n < 0) {
+    fprintf(stderr, "Can't read file '%s'\n", name);
+    return 1;
+  }
+  // one byte is always left for this
+  if (opts->patterns_len > start && opts->patterns[opts->patterns_len - 1] != '\n')
+    opts->patterns[opts->patterns_len++] = '\n';
+  return 0;
 }
 
-RE* RE_gen(char* regex)
+// Search all files with opts->threads threads which share 're' and print the
+// matching lines, prefixed with the file name if there is more than one file,
+// in the same order as a search of one file after the other would.
+// With -r the files are searched while the directories are still being
+// listed, so each file is written as soon as it is done instead.
+// Returns one of the EXIT_ codes.
+int grep_files(RE* re, grep_opts* opts, char** names, int num_files)
 {
-  RE* out = malloc(sizeof(RE));
-  out->match_start = 0;
-  out->match_end = 0;
-  if (regex[0] == '^') {
-    out->match_start = 1;
-    regex++;
+  search s;
+  worker* w;
+  work_item item;
+  struct stat st;
+  int status = 0;
+  int matched = 0;
+
+  s.re = re;
+  s.opts = opts;
+  s.num_files = num_files;
+  s.show_names = num_files > 1;
+  output_order_init(&s.order, num_files, NULL);
+  pthread_mutex_init(&s.write_lock, NULL);
+  s.num_workers = opts->threads;
+  if (!opts->recursive && num_files < s.num_workers)
+    s.num_workers = num_files;
+  s.workers = calloc(s.num_workers, sizeof(worker));
+  // threads which have no file of their own help with the large ones
+  s.chunk_threads = opts->threads / s.num_workers;
+  s.pending = num_files;
+  s.pushes = 0;
+  pthread_mutex_init(&s.idle_lock, NULL);
+  pthread_cond_init(&s.idle_cond, NULL);
+
+  for (int id = 0; id < s.num_workers; id++) {
+    w = &s.workers[id];
+    // the first num_workers counters are those of the workers, the others
+    // are split among the threads they start for chunks
+    if (opts->stats != NULL)
+      opts->stats->threads[id].helpers = opts->stats->threads + s.num_workers +
+        id * (s.chunk_threads - 1);
+    w->s = &s;
+    w->id = id;
+    w->queue.items = NULL;
+    w->queue.cap = 0;
+    w->queue.head = 0;
+    w->queue.count = 0;
+    pthread_mutex_init(&w->queue.lock, NULL);
   }
 
-  if (regex[strlen(regex) - 1] == '$') {
-    out->match_end = 1;
-    regex[strlen(regex) - 1] = '\0';
+  // argument i goes to thread i % num_workers, so all threads start at the
+  // front of the arguments and the output of the first files can be written
+  // early. Pushing them to the front in reverse keeps them in order.
+  for (int i = num_files - 1; i >= 0; i--) {
+    item.path = names[i];
+    item.index = i;
+    item.is_dir = opts->recursive &&
+      stat(names[i][0] != '\0' ? names[i] : ".", &st) == 0 && S_ISDIR(st.st_mode);
+    if (item.is_dir)
+      s.show_names = 1;
+    queue_push_front(&s.workers[i % s.num_workers].queue, item);
+  }
+  for (int i = 0; s.show_names && i < num_files; i++) {
+    s.order.outputs[i].prefix = names[i];
+    s.order.outputs[i].prefix_len = strlen(names[i]);
   }
 
-  nfa* re_nfa = generate_nfa(regex);
-  out->dfa = nfa_to_dfa(re_nfa);
-  free_nfa(re_nfa);
-  return out;
+  // the first queue is searched by this thread, the items of any other one
+  // whose thread couldn't be started are stolen by the others
+  for (int id = 1; id < s.num_workers; id++)
+    s.workers[id].started =
+      pthread_create(&s.workers[id].thread, NULL, search_worker, &s.workers[id]) == 0;
+  search_worker(&s.workers[0]);
+  for (int id = 1; id < s.num_workers; id++) {
+    if (s.workers[id].started)
+      pthread_join(s.workers[id].thread, NULL);
+  }
+
+  for (int id = 0; id < s.num_workers; id++) {
+    status |= s.workers[id].status;
+    matched |= s.workers[id].matched;
+    pthread_mutex_destroy(&s.workers[id].queue.lock);
+    free(s.workers[id].queue.items);
+  }
+  pthread_cond_destroy(&s.idle_cond);
+  pthread_mutex_destroy(&s.idle_lock);
+  pthread_mutex_destroy(&s.write_lock);
+  output_order_free(&s.order);
+  free(s.workers);
+  return status ? EXIT_TROUBLE : matched ? EXIT_MATCH : EXIT_NO_MATCH;
 }
 
-void RE_destroy(RE* re)
+// Work on items until there are none left in any queue and no other thread
+// is listing a directory which could add more.
+// The RE is shared by all threads, only the states of a lazy DFA are added
+// while searching so each thread gets a DFA of its own for them.
+void* search_worker(void* arg)
 {
-  free_dfa(re->dfa);
-  free(re);
+  worker* w = arg;
+  search* s = w->s;
+  RE* re = s->re;
+  work_item item;
+
+  if (s->opts->stats != NULL)
+    stats_thread_start(&s->opts->stats->threads[w->id]);
+  if (re->table != NULL && re->table->lazy != NULL)
+    re = RE_thread_copy(re);
+
+  while (next_item(w, &item)) {
+    if (item.is_dir)
+      walk_dir(w, item.path);
+    else
+      search_item(w, re, &item);
+    if (item.index < 0)
+      free(item.path);
+
+    // whoever waits for more items has to know when there won't be any
+    if (__atomic_sub_fetch(&s->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_lock(&s->idle_lock);
+      pthread_cond_broadcast(&s->idle_cond);
+      pthread_mutex_unlock(&s->idle_lock);
+    }
+  }
+
+  stats_lazy(re);
+  if (re != s->re)
+    RE_destroy(re);
+  stats_thread_end();
+  return NULL;
 }
 
-int RE_run(RE* re, const char* regex, const char* text)
+// Search one file. The arguments have an output of their own which is written
+// in order, with -r any file is written once it is done.
+void search_item(worker* w, RE* re, work_item* item)
 {
-  if (regex[0] == '^') {
-    return RE_matchhere(re, regex + 1, text);
+  search* s = w->s;
+  output own = {.next_out = NULL}; // not in an order, written once complete
+  output* out = &own;
+  int fd;
+
+  if (!s->opts->recursive) {
+    out = &s->order.outputs[item->index];
+  } else if (s->show_names) {
+    own.prefix = item->path;
+    own.prefix_len = strlen(item->path);
+  }
+
+  if ((fd = open(item->path, O_RDONLY)) < 0) {
+    fprintf(stderr, "Can't open file '%s'\n", item->path);
+    w->status = 1;
   } else {
-    do {
-      if (RE_matchhere(re, regex, text))
-        return 1;
-    } while (*text++ != '\0');
+    if (grep_file(re, s->opts, fd, item->path, s->chunk_threads, out))
+      w->status = 1;
+    close(fd);
+    output_summary(out, item->path);
+    w->matched |= out->count > 0;
+    if (cur_stats != NULL)
+      cur_stats->files++;
   }
-  return 0;
+
+  if (!s->opts->recursive) {
+    output_finish(&s->order, item->index);
+  } else {
+    pthread_mutex_lock(&s->write_lock);
+    output_flush(out);
+    pthread_mutex_unlock(&s->write_lock);
+    output_free(&own);
+  }
+  stats_phase(PHASE_OTHER);
 }
 
-int RE_matchhere(RE* re, const char* regex, const char* text)
+// Add the files and directories in 'path' to the queue of the thread. Like
+// grep -r, symbolic links are only followed if they are arguments.
+// An empty path stands for the current directory.
+void walk_dir(worker* w, const char* path)
 {
-  dfa_node* curr_node = re->dfa->start;
+  grep_opts* opts = w->s->opts;
+  DIR* dir;
+  int fd;
+  struct dirent* entry;
+  struct stat st;
+  int is_dir;
+  size_t path_len = strlen(path);
+  work_item* found = NULL;
+  int num_found = 0;
+  int cap = 0;
+  char* child;
 
-  int end = 0;
-  int match = 0;
-  do {
-    // only finish when we reach an end node AND
-    // if we need to match the end (because of $) the text is over
-    if (curr_node->isend && (!re->match_end || text[0] == '\0')) {
-      end = 1;
-      break;
+  fd = openat(AT_FDCWD, path_len > 0 ? path : ".", O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+    fprintf(stderr, "Can't open directory '%s'\n", path);
+    w->status = 1;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  // readdir reads the entries in large blocks with getdents
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (entry->d_type == DT_DIR || entry->d_type == DT_REG) {
+      is_dir = entry->d_type == DT_DIR;
+    } else if (entry->d_type == DT_UNKNOWN &&
+        fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+      is_dir = S_ISDIR(st.st_mode);
+    } else {
+      continue; // links, devices, sockets, ...
     }
+    if (walk_skip(opts, entry->d_name, is_dir))
+      continue;
 
-    match = 0;
+    child = malloc(path_len + strlen(entry->d_name) + 2);
+    if (path_len == 0)
+      strcpy(child, entry->d_name);
+    else if (path[path_len - 1] == '/')
+      sprintf(child, "%s%s", path, entry->d_name);
+    else
+      sprintf(child, "%s/%s", path, entry->d_name);
 
-    // loop over all edges leading to next nodes
-    dfa_edge* iter;
-    for (iter = curr_node->next_l; iter != NULL; iter = iter->next) {
-      if (char_match(iter->cond_ch, text[0])) {
-        curr_node = iter->node;
-        match = 1;
-        break; // only one edge can match the current character
-      }
+    if (num_found == cap) {
+      cap = cap ? cap * 2 : 64;
+      found = realloc(found, sizeof(work_item) * cap);
     }
-    
-  } while (match && *text++ != '\0');
+    found[num_found++] = (work_item){child, -1, is_dir};
+  }
+  closedir(dir);
 
-  return end;
+  push_items(w, found, num_found);
+  free(found);
 }
 
-
-// Convert Non-deterministic Finite Automaton to Deterministic Finite Automaton
-dfa* nfa_to_dfa(nfa* nfa_in)
+// Whether -r leaves out the file or directory because of the globs
+int walk_skip(grep_opts* opts, const char* name, int is_dir)
 {
-  dfa* out = malloc(sizeof(dfa));
-  always_g* alw_g = always_group(nfa_in->start);
-  dfagen_node* worklist = insert_into_dfagen_list(NULL, alw_g->isend, alw_g->nfas);
-  free_always_group(alw_g); // FREE
-  
-  dfagen_node* worked_list = NULL;
+  if (is_dir) {
+    for (int i = 0; i < opts->num_exclude_dirs; i++) {
+      if (fnmatch(opts->exclude_dirs[i], name, 0) == 0)
+        return 1;
+    }
+    return 0;
+  }
 
-  out->start = worklist->node;
-  out->num_nodes = 1;
-  dfa_node* curr_node;
-  dfagen_node* tmp;
+  for (int i = 0; i < opts->num_excludes; i++) {
+    if (fnmatch(opts->excludes[i], name, 0) == 0)
+      return 1;
+  }
+  for (int i = 0; i < opts->num_includes; i++) {
+    if (fnmatch(opts->includes[i], name, 0) == 0)
+      return 0;
+  }
+  return opts->num_includes > 0;
+}
 
-  dfagen_node* next;
-  nfal* iter_nfa;
-  nfa_edge* iter_edge;
-  char cond_ch;
-  nfa_2dlist* conns;
-  nfa_2dlist* iter_conns;
+// Take the next item from the front of the own queue or, if that is empty,
+// steal one from the back of another. If there is none but other threads are
+// still working on items, wait for them to add more.
+// Returns 0 once all items are done.
+int next_item(worker* w, work_item* item)
+{
+  search* s = w->s;
+  work_queue* q;
+  int pushes;
+  int found;
 
-  while (worklist != NULL) {
-    curr_node = worklist->node;
-    // loop over all nodes belonging to current dfa_node
-    conns = NULL;
-    for (iter_nfa = worklist->nfas; iter_nfa != NULL; iter_nfa = iter_nfa->next) {
-      // access nfa node with iter_nfa->node;
-      // loop over edges of the node
-      for (iter_edge = iter_nfa->node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
-        if (iter_edge->always) // ignore always connections since they have
-                               // already been captured by always_group
-          continue;
-        alw_g = always_group(iter_edge->node); // get epsilon closure of this edge
-        conns = insert_into_conns(conns, iter_edge->cond_ch, alw_g->isend, alw_g->nfas);
-        free_always_group(alw_g); // FREE
+  for (;;) {
+    pushes = __atomic_load_n(&s->pushes, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < s->num_workers; i++) {
+      q = &s->workers[(w->id + i) % s->num_workers].queue;
+      pthread_mutex_lock(&q->lock);
+      found = q->count > 0;
+      if (found && i == 0) {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+      } else if (found) {
+        *item = q->items[(q->head + q->count - 1) % q->cap];
       }
+      q->count -= found;
+      pthread_mutex_unlock(&q->lock);
+      if (found)
+        return 1;
     }
 
-    // remove first item from worklist queue
-    tmp = worklist->next;
-    worked_list = insert_node_into_dfagen_list(worked_list, worklist);
-    // note that worklist->nfas does not have to be freed since it is used by
-    // worked_list
-    free_nfa_list(worklist->nfas);
-
-    free(worklist);
-    worklist = tmp;
-    // loop over the sets of nodes for each outgoing character edge
-    for (iter_conns = conns; iter_conns != NULL; iter_conns = iter_conns->next) {
-      // add dfagen_node to worklist with this set of nfa_nodes
-      if ((tmp = find_dfagen_node(worked_list, iter_conns->nfas)) == NULL) {
-        worklist = insert_into_dfagen_list(worklist, iter_conns->isend, iter_conns->nfas);
-        worklist->node->isend = iter_conns->isend;
-        worklist->node->next_l = NULL;
-        tmp = worklist;
-        out->num_nodes++;
-      }
-      curr_node->next_l = insert_dfa_edge(curr_node->next_l, iter_conns->cond_ch, tmp->node);
+    pthread_mutex_lock(&s->idle_lock);
+    if (__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) == 0) {
+      pthread_mutex_unlock(&s->idle_lock);
+      return 0;
     }
-    free_nfa_2dlist(conns);
+    if (__atomic_load_n(&s->pushes, __ATOMIC_ACQUIRE) == pushes)
+      pthread_cond_wait(&s->idle_cond, &s->idle_lock);
+    pthread_mutex_unlock(&s->idle_lock);
   }
-  free_dfagen_list(worked_list);
+}
+
+// Add the items to the front of the own queue and wake up idle threads
+void push_items(worker* w, work_item* items, int n)
+{
+  search* s = w->s;
 
+  if (n == 0)
+    return;
+  // the directory these came from is still pending, so 'pending' can't drop
+  // to 0 before it is increased
+  __atomic_add_fetch(&s->pending, n, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&w->queue.lock);
+  for (int i = n - 1; i >= 0; i--)
+    queue_push_front(&w->queue, items[i]);
+  pthread_mutex_unlock(&w->queue.lock);
 
-  return out;
+  pthread_mutex_lock(&s->idle_lock);
+  __atomic_add_fetch(&s->pushes, 1, __ATOMIC_ACQ_REL);
+  pthread_cond_broadcast(&s->idle_cond);
+  pthread_mutex_unlock(&s->idle_lock);
 }
 
+// The caller has to hold the lock of the queue
+void queue_push_front(work_queue* q, work_item item)
+{
+  work_item* items;
 
-// Generate Non-deterministic Finite Automaton for given regular expression
-nfa* generate_nfa(const char* regex) {
-  nfa* out_nfa = malloc(sizeof(nfa));
-  nfa_node* start;
-  nfa_node* end;
-  if (regex[0] == '\0') {
-    start = malloc(sizeof(nfa_node));
-    end = malloc(sizeof(nfa_node));
-    start->isend = 0;
-    start->next_l = insert_nfa_edge(NULL, 1, '\0', end);
-    end->isend = 1;
-    end->next_l = NULL;
-    out_nfa->num_nodes = 2;
-  } else if (regex[1] == '\0') {
-    start = malloc(sizeof(nfa_node));
-    end = malloc(sizeof(nfa_node));
-    start->isend = 0;
-    start->next_l = insert_nfa_edge(NULL, 0, regex[0], end);
-    end->isend = 1;
-    end->next_l = NULL;
-    out_nfa->num_nodes = 2;
-  } else {
-    const char* regex_end;
-    char* left_regex;
-    if (regex[0] == '(') {
-      regex_end = strstr(regex, ")");
-      int size = regex_end - (regex + 1);
-      left_regex = strndup(regex + 1, size);
-      left_regex[size-1] = '\0'; // remove trailing ')'
-    } else {
-      regex_end = regex;
-      left_regex = strndup(regex, 1); // this will just give the first
-                                      // character of the regex with '\0'
-                                      // appended
-    }
-
-    nfa* first = generate_nfa(left_regex);
-    free(left_regex);
-    nfa* second;
-    if (regex_end[1] == '*') { // iteration
-      second = generate_nfa(regex_end + 2);
-      start = malloc(sizeof(nfa_node));
-      start->isend = 0;
-      start->next_l = insert_nfa_edge(NULL, 1, '\0', first->start);
-      first->start->next_l = insert_nfa_edge(first->start->next_l, 1, '\0', second->start);
-      first->end->next_l =
-        insert_nfa_edge(first->end->next_l, 1, '\0', first->start);
-      first->end->isend = 0;
-      end = second->end;
-      out_nfa->num_nodes = 1;
-    } else { // concatenation
-      second = generate_nfa(regex_end + 1);
-      first->end->isend = 0;
-      first->end->next_l =
-        insert_nfa_edge(first->end->next_l, 1, '\0', second->start);
-      start = first->start;
-      end = second->end;
-      out_nfa->num_nodes = 0;
-    }
-    out_nfa->num_nodes += first->num_nodes + second->num_nodes;
-    free(first);
-    free(second);
-  }
-  out_nfa->start = start;
-  out_nfa->end = end;
-  return out_nfa;
+  if (q->count == q->cap) { // unroll the ring into a buffer twice as large
+    items = malloc(sizeof(work_item) * (q->cap ? q->cap * 2 : 64));
+    for (int i = 0; i < q->count; i++)
+      items[i] = q->items[(q->head + i) % q->cap];
+    free(q->items);
+    q->items = items;
+    q->cap = q->cap ? q->cap * 2 : 64;
+    q->head = 0;
+  }
+  q->head = (q->head + q->cap - 1) % q->cap;
+  q->items[q->head] = item;
+  q->count++;
 }
 
+void output_order_init(output_order* order, int count, output* parent)
+{
+  order->outputs = calloc(count, sizeof(output));
+  order->done = calloc(count, 1);
+  order->count = count;
+  order->next_out = 0;
+  pthread_mutex_init(&order->lock, NULL);
+  for (int i = 0; i < count; i++) {
+    order->outputs[i].index = i;
+    order->outputs[i].next_out = &order->next_out;
+    order->outputs[i].parent = parent;
+  }
+}
 
-// HELPER FUNCTIONS
+void output_order_free(output_order* order)
+{
+  pthread_mutex_destroy(&order->lock);
+  free(order->done);
+  free(order->outputs);
+}
 
-always_g* always_group(nfa_node* node)
+// Mark output 'index' as done and write it together with all outputs after it
+// which are done as well, unless an output before it is still being filled.
+// That output's thread then writes them once it is done.
+void output_finish(output_order* order, int index)
 {
-  always_g* out = malloc(sizeof(always_g));
-  out->isend = node->isend;
-  out->nfas = NULL;
-  out->nfas = insert_into_nfa_list(out->nfas, node);
+  output* out;
 
-  nfa_edge* iter_edge;
-  always_g* tmp_alwg;
-  for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
-    if (iter_edge->always) {
-      tmp_alwg = always_group(iter_edge->node);
-      out->isend = out->isend || tmp_alwg->isend;
-      out->nfas = union_into_nfa_list(out->nfas, tmp_alwg->nfas);
-      free_always_group(tmp_alwg);
-    } else {
-      if (iter_edge->node == node)
-      out->nfas = insert_into_nfa_list(out->nfas, iter_edge->node);
-    }
+  pthread_mutex_lock(&order->lock);
+  order->done[index] = 1;
+  while (order->next_out < order->count && order->done[order->next_out]) {
+    out = &order->outputs[order->next_out];
+    output_flush(out);
+    output_free(out);
+    // print_line reads this without the lock
+    __atomic_store_n(&order->next_out, order->next_out + 1, __ATOMIC_RELEASE);
   }
-
-
-  return out;
+  pthread_mutex_unlock(&order->lock);
 }
 
-nfal* insert_into_nfa_list(nfal* list, nfa_node* node)
+// Write the output to stdout. The output of a chunk is appended to the output
+// of its file instead, unless that is next anyway.
+void output_flush(output* out)
 {
-  nfal* out = malloc(sizeof(nfal));
-  out->node = node;
-  out->next = list;
-  return out;
+  output* parent = out->parent;
+
+  if (out->len > 0 && parent != NULL && !output_is_next(parent)) {
+    output_reserve(parent, out->len);
+    memcpy(parent->buf + parent->len, out->buf, out->len);
+    parent->len += out->len;
+  } else if (out->len > 0) {
+    if (parent != NULL)
+      output_flush(parent); // whatever the chunks before this one printed
+    int phase = stats_phase(PHASE_WRITE);
+    write_all(STDOUT_FILENO, &(struct iovec){out->buf, out->len}, 1);
+    stats_phase(phase);
+  }
+  out->len = 0;
+  output_write_slices(out);
 }
 
-// constructs union of lists a and b
-// no copies of nfal* nodes are made just next references are changed
-nfal* union_into_nfa_list(nfal* a, nfal* b)
+// Write the slices, which have to be written before their input buffer is
+// changed or unmapped. There are only slices if the output is written
+// directly, see output_direct.
+void output_write_slices(output* out)
 {
-  nfal* out = a;
-  nfal* next;
-  nfal* copy = copy_nfa_list(b);
-  for (nfal* iter = copy; iter != NULL; iter = next) {
-    next = iter->next;
-    if (!(contains_nfa_list(a, iter->node))) {
-      iter->next = out; // insert at start of output list
-      out = iter;
-    } else {
-      free(iter);
-    }
+  if (out->num_slices > 0) {
+    int phase = stats_phase(PHASE_WRITE);
+    write_all(STDOUT_FILENO, out->slices, out->num_slices);
+    stats_phase(phase);
   }
-  return out;
+  out->num_slices = 0;
+  out->slice_bytes = 0;
 }
 
-int contains_nfa_list(nfal* list, nfa_node* node)
+void output_free(output* out)
 {
-  for (nfal* iter = list; iter != NULL; iter = iter->next)
-    if (iter->node == node)
-      return 1;
-  return 0;
+  free(out->buf);
+  free(out->slices);
+  out->buf = NULL;
+  out->slices = NULL;
 }
 
-int match_nfa_list(nfal* a, nfal* b)
+// Whether all outputs before this one have been written. Outputs without an
+// order are only written once they are complete.
+int output_is_next(output* out)
 {
-  nfal* iter_a;
-  nfal* iter_b;
-  for (iter_a = a, iter_b = b;
-      iter_a != NULL && iter_b != NULL;
-      iter_a = iter_a->next, iter_b = iter_b->next) {
-    if (iter_a->node != iter_b->node)
-      return 0;
-  }
-  return (iter_a == NULL && iter_b == NULL);
+  return out->next_out != NULL &&
+    __atomic_load_n(out->next_out, __ATOMIC_ACQUIRE) == out->index;
 }
 
-dfagen_node* find_dfagen_node(dfagen_node* list, nfal* nfas)
+// Whether lines can be written straight from the input buffer because no
+// other output has to come first. Once that is the case it stays that way.
+int output_direct(output* out)
 {
-  dfagen_node* iter;
-  for (iter = list; iter != NULL; iter = iter->next)
-    if (match_nfa_list(iter->nfas, nfas))
-      return iter;
-  return NULL;
+  if (!out->direct)
+    out->direct = output_is_next(out) &&
+      (out->parent == NULL || output_is_next(out->parent));
+  return out->direct;
 }
 
-// checks if cond_ch already in list
-// in that case: merge 'nodes' with 'list'
-// otherwise: add 'nodes' to new node with cond_ch = 'cond_ch'
-// set isend = 1 if one of the 'nodes' has isend = 1
-nfa_2dlist* insert_into_conns(nfa_2dlist* conns, char cond_ch, int isend, nfal* nfas)
+// Add a slice, a piece which directly follows the last one just makes that
+// one longer
+void output_slice(output* out, const char* data, size_t len)
 {
-  nfa_2dlist* out = conns;
-  int found = 0;
-  for (nfa_2dlist* iter = conns; iter != NULL; iter = iter->next) {
-    if (iter->cond_ch == cond_ch) {
-      found = 1;
-      iter->nfas = union_into_nfa_list(iter->nfas, copy_nfa_list(nfas));
-      iter->isend = iter->isend || isend;
-    }
-  }
+  struct iovec* last;
 
-  if (!found) {
-    nfa_2dlist* newl = malloc(sizeof(nfa_2dlist));
-    newl->isend = isend;
-    newl->nfas = copy_nfa_list(nfas);
-    newl->cond_ch = cond_ch;
-    newl->next = out;
-    out = newl;
+  if (out->slices == NULL)
+    out->slices = malloc(sizeof(struct iovec) * OUTPUT_SLICES);
+  out->slice_bytes += len;
+  if (out->num_slices > 0) {
+    last = out->slices + out->num_slices - 1;
+    if ((char*)last->iov_base + last->iov_len == data) {
+      last->iov_len += len;
+      return;
+    }
   }
-
-  return out;
+  if (out->num_slices == OUTPUT_SLICES)
+    output_write_slices(out);
+  out->slices[out->num_slices++] = (struct iovec){(void*)data, len};
 }
 
-nfal* copy_nfa_list(nfal* list)
+// writev all of 'iov' to fd. Errors on stdout are ignored like they were with
+// stdio.
+// Returns 0 if everything was written, -1 otherwise.
+int write_all(int fd, struct iovec* iov, int n)
 {
-  nfal* out = NULL;
-  for (nfal* iter = list; iter != NULL; iter = iter->next) {
-    out = insert_into_nfa_list(out, iter->node);
+  ssize_t written;
+
+  while (n > 0) {
+    written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    // skip what was written, writev may stop in the middle of a slice
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
   }
-  return out;
+  return 0;
 }
 
-dfagen_node* insert_into_dfagen_list(dfagen_node* worklist, int isend, nfal* nfas)
+// Make room for 'len' more bytes in the buffer
+void output_reserve(output* out, size_t len)
 {
-  dfagen_node* out = malloc(sizeof(dfagen_node));
-  out->nfas = copy_nfa_list(nfas);
-  out->node = malloc(sizeof(dfa_node));
-  out->node->isend = isend;
-  out->node->next_l = NULL;
-  out->next = worklist;
-  return out;
+  size_t need = out->len + len;
+
+  if (need > out->cap) {
+    if (out->cap == 0)
+      out->cap = OUTPUT_FLUSH;
+    while (out->cap < need)
+      out->cap *= 2;
+    out->buf = realloc(out->buf, out->cap);
+  }
 }
 
-dfagen_node* insert_node_into_dfagen_list(dfagen_node* worked_list, dfagen_node* item)
+// Regular files of at least MMAP_MIN bytes are mapped into memory and scanned
+// in place, everything else (pipes, terminals, small files or files which
+// can't be mapped) goes through the read() loop of grep_fd.
+// Mapped files are split into chunks for up to 'threads' threads if they are
+// large enough.
+int grep_file(RE* re, grep_opts* opts, int fd, const char* name, int threads,
+    output* out)
 {
-  dfagen_node* out = malloc(sizeof(dfagen_node));
-  out->nfas = copy_nfa_list(item->nfas);
-  out->node = item->node;
-  out->next = worked_list;
-  return out;
+  struct stat st;
+  char* map;
+  size_t len;
+  size_t done;
+
+  if (output_max_count == 0) // -m 0
+    return 0;
+  if (!opts->use_mmap || fstat(fd, &st) < 0 ||
+      !S_ISREG(st.st_mode) || st.st_size < MMAP_MIN)
+    return grep_fd(re, fd, name, opts->recursive, out);
+
+  len = st.st_size;
+  stats_phase(PHASE_READ);
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return grep_fd(re, fd, name, opts->recursive, out);
+  madvise(map, len, MADV_SEQUENTIAL);
+
+  if (opts->recursive && is_binary(map, len)) {
+    // skipped
+  } else if (threads > 1 && len >= 2 * CHUNK_MIN && opts->max_count < 0) {
+    // with -m the chunks would have to know how many matches the ones before
+    // them found
+    grep_chunks(re, map, len, threads, out);
+  } else {
+    stats_phase(PHASE_SCAN);
+    done = grep_lines(re, map, len, out);
+    if (done < len && !out->stop && RE_run(re, map + done, len - done))
+      print_last_line(out, map + done, len - done); // no '\n' at the end
+    stats_scanned(map, len, out->count);
+  }
+  output_write_slices(out);
+  stats_phase(PHASE_READ);
+  munmap(map, len);
+  stats_phase(PHASE_OTHER);
+  return 0;
 }
 
-nfa_edge* insert_nfa_edge(nfa_edge* start, int always, char cond_ch, nfa_node* node)
+// Split the mapped file into chunks which end after a '\n' and search them
+// with up to 'threads' threads. The DFA starts every chunk in its start
+// state, which is also the state at the start of every line, so each chunk
+// is searched as if it was a file of its own. Their outputs are appended to
+// 'out' in the order of the chunks.
+void grep_chunks(RE* re, const char* map, size_t len, int threads, output* out)
 {
-  nfa_edge* out = malloc(sizeof(nfa_edge));
-  out->cond_ch = cond_ch;
-  out->node = node;
-  out->next = start;
-  out->always = always;
-  return out;
+  chunk_search c;
+  size_t chunk_size = len / ((size_t)threads * CHUNKS_PER_THREAD);
+  size_t next;
+  const char* nl;
+  pthread_t* tids;
+  int* started;
+
+  if (chunk_size < CHUNK_MIN)
+    chunk_size = CHUNK_MIN;
+  c.re = re;
+  c.map = map;
+  c.bounds = malloc(sizeof(size_t) * (len / chunk_size + 2));
+  c.bounds[0] = 0;
+  c.num_chunks = 0;
+  c.next_chunk = 0;
+  c.stop = 0;
+  c.helper_stats = (cur_stats != NULL) ? cur_stats->helpers : NULL;
+  c.next_helper = 0;
+  while (c.bounds[c.num_chunks] < len) {
+    next = c.bounds[c.num_chunks] + chunk_size;
+    if (next < len) {
+      nl = re->scan->find_byte(map + next - 1, map + len, '\n');
+      next = (nl == NULL) ? len : (size_t)(nl - map) + 1;
+    } else {
+      next = len;
+    }
+    c.bounds[++c.num_chunks] = next;
+  }
+
+  output_order_init(&c.order, c.num_chunks, out);
+  for (int i = 0; i < c.num_chunks; i++) {
+    c.order.outputs[i].prefix = out->prefix;
+    c.order.outputs[i].prefix_len = out->prefix_len;
+  }
+
+  if (threads > c.num_chunks)
+    threads = c.num_chunks;
+  tids = malloc(sizeof(pthread_t) * threads);
+  started = calloc(threads, sizeof(int));
+  for (int t = 1; t < threads; t++)
+    started[t] = pthread_create(&tids[t], NULL, chunk_worker, &c) == 0;
+  chunk_worker(&c);
+  for (int t = 1; t < threads; t++) {
+    if (started[t])
+      pthread_join(tids[t], NULL);
+  }
+
+  output_order_free(&c.order);
+  free(started);
+  free(tids);
+  free(c.bounds);
 }
 
-dfa_edge* insert_dfa_edge(dfa_edge* start, char cond_ch, dfa_node* node)
+// Search chunks until none is left, like search_worker does for files
+void* chunk_worker(void* arg)
 {
-  dfa_edge* out = malloc(sizeof(dfa_edge));
-  out->cond_ch = cond_ch;
-  out->node = node;
-  out->next = start;
-  return out;
-}
+  chunk_search* c = arg;
+  RE* re = c->re;
+  int i;
+  const char* chunk;
+  size_t len;
+  size_t done;
+  output* out;
+  int helper = (c->helper_stats != NULL && cur_stats == NULL);
 
+  // the thread which called grep_chunks counts into its own counters
+  if (helper)
+    stats_thread_start(&c->helper_stats[
+        __atomic_fetch_add(&c->next_helper, 1, __ATOMIC_RELAXED)]);
+  if (re->table != NULL && re->table->lazy != NULL)
+    re = RE_thread_copy(re);
 
-// DEALLOCATION
+  while (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED) &&
+      (i = __atomic_fetch_add(&c->next_chunk, 1, __ATOMIC_RELAXED)) <
+      c->num_chunks) {
+    chunk = c->map + c->bounds[i];
+    len = c->bounds[i + 1] - c->bounds[i];
+    out = &c->order.outputs[i];
+    stats_phase(PHASE_SCAN);
+    done = grep_lines(re, chunk, len, out);
+    if (done < len && !out->stop && RE_run(re, chunk + done, len - done))
+      print_last_line(out, chunk + done, len - done); // last chunk only
+    stats_scanned(chunk, len, out->count);
+    output_write_slices(out);
+    // -l and -L need only one match in any chunk, there is no -m with chunks
+    __atomic_add_fetch(&out->parent->count, out->count, __ATOMIC_RELAXED);
+    if (out->stop)
+      __atomic_store_n(&c->stop, 1, __ATOMIC_RELAXED);
+    output_finish(&c->order, i);
+  }
 
-void free_always_group(always_g* alw_g)
-{
-  free_nfa_list(alw_g->nfas);
-  free(alw_g);
+  if (re != c->re) {
+    stats_lazy(re);
+    RE_destroy(re);
+  }
+  if (helper)
+    stats_thread_end();
+  return NULL;
 }
 
-void free_dfa(dfa* dfa)
+// Read all of 'fd' in blocks of READ_BLOCK bytes and print every line that
+// matches 're'. With 'skip_binary' nothing is printed if the first block is
+// binary.
+// Line boundaries are found with the find_byte kernel. A line which is cut off
+// at the end of a block is moved to the front of the buffer and completed by
+// the next read, growing the buffer if necessary, so there is no limit on the
+// line length.
+int grep_fd(RE* re, int fd, const char* name, int skip_binary, output* out)
 {
-  dfa_node** tofree = malloc(sizeof(dfa_node) * dfa->num_nodes);
-  dfa_edge* next_edge;
-  dfa_edge* iter_edge;
-  
-  FREE_FA_GRAPH(dfa->start, tofree, iter_edge, next_edge, dfa->num_nodes);
+  size_t cap = READ_BLOCK;
+  size_t len = 0;     // bytes of input currently in buf
+  size_t scanned = 0; // bytes at the start of buf known to contain no '\n'
+  size_t done;
+  size_t count;       // matching lines before the block, for --stats
+  char* buf = malloc(cap);
+  ssize_t n;
 
-  free(dfa);
-  free(tofree);
-}
+  for (;;) {
+    if (len == cap) { // a single line fills the whole buffer
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    stats_phase(PHASE_READ);
+    n = read(fd, buf + len, cap - len);
+    stats_phase(PHASE_OTHER);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Can't read file '%s'\n", name);
+      free(buf);
+      return 1;
+    }
+    if (n == 0)
+      break;
+    if (skip_binary && is_binary(buf + len, n)) {
+      free(buf);
+      return 0;
+    }
+    skip_binary = 0; // only the first block is checked
+    len += n;
 
+    // only scan for lines once the carried over line has been completed
+    if (re->scan->find_byte(buf + scanned, buf + len, '\n') == NULL) {
+      scanned = len;
+      continue;
+    }
+    stats_phase(PHASE_SCAN);
+    count = out->count;
+    done = grep_lines(re, buf, len, out);
+    stats_scanned(buf, done, out->count - count);
+    output_write_slices(out);
+    if (out->stop)
+      break;
 
-void free_nfa(nfa* nfa)
-{
-  nfa_node** tofree = malloc(sizeof(nfa_node) * nfa->num_nodes);
-  tofree[0] = nfa->start;
-  nfa_edge* iter_edge;
-  nfa_edge* next_edge;
+    // keep the incomplete last line for the next read
+    len -= done;
+    memmove(buf, buf + done, len);
+    scanned = len;
+  }
 
-  FREE_FA_GRAPH(nfa->start, tofree, iter_edge, next_edge, nfa->num_nodes);
-  
-  free(nfa);
-  free(tofree);
+  if (len > 0 && !out->stop) {
+    stats_phase(PHASE_SCAN);
+    count = out->count;
+    if (RE_run(re, buf, len)) // last line had no '\n'
+      print_last_line(out, buf, len);
+    stats_scanned(buf, len, out->count - count);
+  }
+  output_write_slices(out);
+  free(buf);
+  return 0;
 }
 
-void free_nfa_list(nfal* nfa_list)
+// Files whose first block contains a NUL byte are taken to be binary. This is
+// only checked for the first block read so the rest of the file can still
+// contain some.
+int is_binary(const char* buf, size_t len)
 {
-  nfal* next;
-  for (; nfa_list != NULL; nfa_list = next) {
-    next = nfa_list->next;
-    free(nfa_list);
-  }
+  return memchr(buf, '\0', len < READ_BLOCK ? len : READ_BLOCK) != NULL;
 }
 
-void free_nfa_2dlist(nfa_2dlist* list)
+// Print every complete line of buf which matches 're'.
+// Returns the number of bytes up to and including the last '\n', whatever
+// follows it is an incomplete line.
+size_t grep_lines(RE* re, const char* buf, size_t len, output* out)
 {
-  nfa_2dlist* next;
-  for (; list != NULL; list = next) {
-    next = list->next;
-    free_nfa_list(list->nfas);
-    free(list);
+  const char* end = memrchr(buf, '\n', len);
+  if (end == NULL)
+    return 0;
+  end++; // only complete lines are scanned
+
+  if (re->is_literal) {
+    grep_literal(re, buf, end, out);
+    return end - buf;
   }
-}
 
-void free_dfagen_list(dfagen_node* list)
-{
-  dfagen_node* next;
-  for (; list != NULL; list = next) {
-    next = list->next;
-    free_nfa_list(list->nfas);
-    free(list);
+  const uint32_t* trans = re->table->trans;
+  const uint8_t* classes = re->table->classes;
+  int shift = re->table->shift;
+  const uint8_t* stop = re->table->stop;
+  uint32_t start = re->table->start;
+  uint32_t state = start;
+  uint32_t next;
+  const char* p = buf;
+  const char* line;
+  const char* nl;
+
+  if (re->table->accept[start]) {
+    // the regex matches the empty string so every line matches
+    for (line = buf; line != end && !out->stop; line = nl + 1) {
+      nl = re->scan->find_byte(line, end, '\n');
+      print_line(out, line, nl - line);
+    }
+    return end - buf;
   }
-}
+
+  if (re->literal_len > 0) {
+    grep_candidates(re, buf, end, out);
+    return end - buf;
+  }
+
+  // Run the DFA over the whole buffer, '\n' leads back to the start state.
+  // The boundaries of a line are only looked for once it is known to match.
+  while (p != end) {
+    next = trans[(state << shift) + classes[(unsigned char)*p++]];
+    if (!stop[next]) {
+      state = next;
+      continue;
+    }
+
+    if (next == DFA_UNKNOWN) {
+      state = lazy_dfa_next(re->table, state, p[-1]);
+      if (!stop[state])
+        continue;
+    } else {
+      state = next;
+    }
+
+    if (state == DFA_DEAD) {
+      // nothing left to match on this line, the '\n' just read already
+      // ended it if the start state itself is DFA_DEAD since nothing can
+      // match at all
+      if (p[-1] != '\n')
+        p = re->scan->find_byte(p, end, '\n') + 1;
+      state = start;
+      continue;
+    }
+
+    if (state == re->table->line_match) {
+      // the '\n' which ended the matching line was just read
+      nl = p - 1;
+      if (output_mode != MODE_LINES) {
+        count_line(out);
+      } else {
+        line = memrchr(buf, '\n', nl - buf);
+        line = (line == NULL) ? buf : line + 1;
+        print_line(out, line, nl - line);
+      }
+    } else {
+      // an end node was reached in the middle of the line, without output
+      // only its end is needed to go on with the next one
+      nl = re->scan->find_byte(p, end, '\n');
+      if (output_mode != MODE_LINES) {
+        count_line(out);
+      } else {
+        line = memrchr(buf, '\n', p - buf);
+        line = (line == NULL) ? buf : line + 1;
+        print_line(out, line, nl - line);
+      }
+      p = nl + 1;
+      state = start;
+    }
+    if (out->stop)
+      break;
+  }
+  return end - buf;
+}
+
+// Only lines which contain the required literal of the regex can match, so
+// jump from one occurrence of it to the next with find_literal and run the DFA
+// only over the lines these are in. All other lines are never looked at by the
+// DFA.
+// 'end' has to follow a '\n'.
+void grep_candidates(RE* re, const char* buf, const char* end, output* out)
+{
+  const char* p = buf; // always the start of a line
+  const char* hit;
+  const char* line;
+  const char* nl;
+
+  while (!out->stop && (hit = find_literal(re, p, end)) != NULL) {
+    line = memrchr(p, '\n', hit - p);
+    line = (line == NULL) ? p : line + 1;
+    nl = re->scan->find_byte(hit, end, '\n');
+    if (RE_run(re, line, nl - line))
+      print_line(out, line, nl - line);
+    p = nl + 1;
+  }
+}
+
+// Print every line which contains the literal of 're'. Only the occurrences
+// of the literal are looked at, with $ they also have to be at the end of
+// their line. With ^ it is cheaper to just compare the start of every line.
+// 'end' has to follow a '\n'.
+void grep_literal(RE* re, const char* buf, const char* end, output* out)
+{
+  const char* p = buf;
+  const char* hit;
+  const char* line;
+  const char* nl;
+
+  if (re->match_start) {
+    for (line = buf; line != end && !out->stop; line = nl + 1) {
+      nl = re->scan->find_byte(line, end, '\n');
+      if (literal_run(re, line, nl - line))
+        print_line(out, line, nl - line);
+    }
+    return;
+  }
+
+  while (!out->stop && (hit = find_literal(re, p, end)) != NULL) {
+    if (re->match_end && hit[re->literal_len] != '\n') {
+      p = hit + 1; // the next occurrence may still be at the end of the line
+      continue;
+    }
+    nl = re->scan->find_byte(hit + re->literal_len, end, '\n');
+    if (output_mode != MODE_LINES) {
+      count_line(out);
+    } else {
+      line = memrchr(buf, '\n', hit - buf);
+      line = (line == NULL) ? buf : line + 1;
+      print_line(out, line, nl - line);
+    }
+    p = nl + 1;
+  }
+}
+
+// RE_run for a line without '\n' if the regex is a literal
+int literal_run(RE* re, const char* text, size_t len)
+{
+  size_t lit_len = re->literal_len;
+  if (len < lit_len)
+    return 0;
+  if (re->match_start && re->match_end)
+    return len == lit_len && memcmp(text, re->literal, lit_len) == 0;
+  if (re->match_start)
+    return memcmp(text, re->literal, lit_len) == 0;
+  if (re->match_end)
+    return memcmp(text + len - lit_len, re->literal, lit_len) == 0;
+  return find_literal(re, text, text + len) != NULL;
+}
+
+void print_line(output* out, const char* line, size_t len)
+{
+  output_line(out, line, len, line + len);
+}
+
+// Add the line and 'newline' to the output of its file. If the output is
+// written directly the line is not copied, only the slice of the input buffer
+// it is in is remembered. Otherwise it is copied, and written once the output
+// is next.
+void output_line(output* out, const char* line, size_t len, const char* newline)
+{
+  count_line(out);
+  if (output_mode != MODE_LINES)
+    return;
+  if (!output_direct(out)) {
+    output_reserve(out, out->prefix_len + 1 + len + 1);
+    if (out->prefix != NULL) {
+      memcpy(out->buf + out->len, out->prefix, out->prefix_len);
+      out->len += out->prefix_len;
+      out->buf[out->len++] = ':';
+    }
+    memcpy(out->buf + out->len, line, len);
+    out->len += len;
+    out->buf[out->len++] = '\n';
+    if (out->len >= OUTPUT_FLUSH && output_is_next(out))
+      output_flush(out); // to the output of the file of a chunk
+    return;
+  }
+
+  if (out->len > 0 || (out->parent != NULL && out->parent->len > 0))
+    output_flush(out); // what was copied before the output was next
+  if (out->prefix != NULL) {
+    output_slice(out, out->prefix, out->prefix_len);
+    output_slice(out, ":", 1);
+  }
+  if (newline == line + len) {
+    output_slice(out, line, len + 1);
+  } else {
+    output_slice(out, line, len);
+    output_slice(out, newline, 1);
+  }
+  if (out->slice_bytes > output_flush_bytes)
+    output_write_slices(out);
+}
+
+// Count a matching line without printing it, which is all that the modes
+// other than MODE_LINES need. -q is done with the first one.
+void count_line(output* out)
+{
+  if (output_mode == MODE_QUIET)
+    exit(EXIT_MATCH);
+  if (++out->count >= output_max_count)
+    out->stop = 1;
+}
+
+// Add what -c, -l and -L print for a file once it has been searched
+void output_summary(output* out, const char* name)
+{
+  size_t name_len = strlen(name);
+
+  if (output_mode == MODE_COUNT) {
+    output_reserve(out, out->prefix_len + 1 + 3 * sizeof(size_t) + 1);
+    if (out->prefix != NULL)
+      out->len += sprintf(out->buf + out->len, "%s:", out->prefix);
+    out->len += sprintf(out->buf + out->len, "%zu\n", out->count);
+  } else if (output_mode == MODE_FILES || output_mode == MODE_FILES_WITHOUT) {
+    if ((out->count > 0) != (output_mode == MODE_FILES))
+      return;
+    output_reserve(out, name_len + 1);
+    memcpy(out->buf + out->len, name, name_len);
+    out->len += name_len;
+    out->buf[out->len++] = '\n';
+  }
+}
+
+// print_line for the last line of a file which has no '\n' after it
+void print_last_line(output* out, const char* line, size_t len)
+{
+  output_line(out, line, len, "\n");
+}
+
+
+RE* RE_gen(const char* regex, grep_opts* opts)
+{
+  RE* out = malloc(sizeof(RE));
+  arena scratch = {NULL, 0}; // the DFA graph and other temporary data
+  size_t len = strlen(regex);
+  out->match_start = 0;
+  out->match_end = 0;
+  out->mem = (arena){NULL, 0};
+  out->scan = select_scan_kernels();
+  out->table = NULL;
+  out->literal = arena_alloc(&out->mem, len + 1);
+
+  // without any special characters apart from ^ and $ around it the regex is
+  // only searched for as a string and no automaton is needed at all
+  out->is_literal = opts->prefilter && is_literal_regex(regex, len);
+  if (out->is_literal) {
+    out->match_start = (regex[0] == '^');
+    out->match_end = (regex[len - 1] == '$');
+    out->literal_len = len - out->match_start - out->match_end;
+    memcpy(out->literal, regex + out->match_start, out->literal_len);
+    out->literal[out->literal_len] = '\0';
+    choose_rare_pair(out);
+    if (opts->dfa_stats)
+      fprintf(stderr, "Literal search, no DFA\n");
+    if (opts->stats != NULL)
+      opts->stats->automaton = "literal";
+    return out;
+  }
+
+  out->literal_len = opts->prefilter ? required_literal(regex, out->literal) : 0;
+  choose_rare_pair(out);
+  if (opts->dfa_stats && out->literal_len > 0)
+    fprintf(stderr, "Required literal: '%s'\n", out->literal);
+
+  // a table stored by an earlier run saves building the NFA and the DFA
+  char* key = NULL;
+  size_t key_len = 0;
+  if (opts->cache_dir != NULL && !opts->lazy) {
+    key = dfa_cache_key(regex, len, 0, opts->minimize, &key_len);
+    out->table = dfa_cache_load(opts->cache_dir, key, key_len, opts->dfa_cache);
+    if (out->table != NULL) {
+      free(key);
+      out->match_end = (out->table->line_match != out->table->start);
+      if (opts->dfa_stats)
+        fprintf(stderr, "DFA states: %d, from the cache\n", out->table->num_states -
+            DFA_FIRST - (out->table->line_match != out->table->start));
+      if (opts->stats != NULL) {
+        opts->stats->automaton = "DFA from the cache";
+        opts->stats->dfa_states = out->table->num_states - DFA_FIRST;
+        opts->stats->num_classes = out->table->num_classes;
+      }
+      return out;
+    }
+  }
+
+  int next_id = 0;
+  nfa* re_nfa = generate_nfa(regex, &next_id, &out->mem);
+  if (re_nfa == NULL) {
+    free(key);
+    arena_free(&out->mem);
+    free(out);
+    return NULL;
+  }
+  out->match_end = re_nfa->has_eol;
+  out->match_start = nfa_anchored(re_nfa);
+  if (!out->match_start)
+    add_search_loop(re_nfa, &out->mem);
+  nfa_closures(re_nfa, &out->mem);
+
+  out->table = new_dfa_table(re_nfa);
+  if (opts->dfa_stats)
+    fprintf(stderr, "Byte classes: %d\n", out->table->num_classes);
+  if (opts->stats != NULL) {
+    opts->stats->nfa_nodes = re_nfa->num_nodes;
+    opts->stats->num_classes = out->table->num_classes;
+  }
+
+  // the whole DFA is only built up front if its table fits into the cache
+  // and it is quick to build, everything else is left to the lazy DFA
+  dfa* re_dfa = NULL;
+  size_t max_states = opts->dfa_cache / (sizeof(uint32_t) << out->table->shift);
+  if (max_states > DFA_EAGER_STATES)
+    max_states = DFA_EAGER_STATES;
+  if (!opts->lazy)
+    re_dfa = nfa_to_dfa(re_nfa, out->table, max_states, &scratch);
+  if (re_dfa == NULL) {
+    free(key);
+    arena_free(&scratch);
+    lazy_dfa_new(out->table, re_nfa, NULL, out->match_end, opts->dfa_cache,
+        &out->mem);
+    if (opts->dfa_stats)
+      fprintf(stderr, "DFA states: built lazily\n");
+    if (opts->stats != NULL)
+      opts->stats->automaton = "lazy DFA";
+    return out;
+  }
+  if (opts->stats != NULL) {
+    opts->stats->dfa_states = re_dfa->num_nodes;
+    opts->stats->dfa_edges = re_dfa->num_edges;
+  }
+  dfa_flatten(out->table, re_dfa, &scratch);
+  arena_reset(&scratch); // the DFA graph is not needed anymore
+
+  int num_states = out->table->num_states - DFA_FIRST;
+  if (opts->minimize > 0 || (opts->minimize < 0 && num_states >= MINIMIZE_MIN)) {
+    dfa_minimize(out->table, &scratch);
+    if (opts->dfa_stats)
+      fprintf(stderr, "DFA states: %d, minimized: %d\n", num_states,
+          out->table->num_states - DFA_FIRST);
+    if (opts->stats != NULL)
+      opts->stats->min_states = out->table->num_states - DFA_FIRST;
+  } else if (opts->dfa_stats) {
+    fprintf(stderr, "DFA states: %d\n", num_states);
+  }
+  arena_free(&scratch);
+  dfa_add_newlines(out->table, out->match_end);
+  if (key != NULL)
+    dfa_cache_store(opts->cache_dir, key, key_len, out->table);
+  free(key);
+  return out;
+}
+
+// RE for -F: 'patterns' are strings, each followed by a '\n', and a line
+// matches if it contains any of them. A single one is searched for like the
+// literal of a regex, several are put into an Aho-Corasick trie which becomes
+// the DFA. Just like the DFA of a regex its table is built up front if it fits
+// into the DFA cache and lazily otherwise.
+RE* RE_gen_fixed(const char* patterns, size_t len, grep_opts* opts)
+{
+  RE* out = malloc(sizeof(RE));
+  arena scratch = {NULL, 0};
+  struct timespec t0, t1;
+  ac_trie* trie;
+  int num_states;
+  size_t row;
+  char* key = NULL;
+  size_t key_len = 0;
+
+  out->match_start = 0;
+  out->match_end = 0;
+  out->mem = (arena){NULL, 0};
+  out->scan = select_scan_kernels();
+  out->literal = NULL;
+  out->literal_len = 0;
+  out->is_literal = 0;
+  out->table = NULL;
+
+  if (opts->prefilter && len > 1 && memchr(patterns, '\n', len) == patterns + len - 1) {
+    out->literal = arena_alloc(&out->mem, len);
+    memcpy(out->literal, patterns, len - 1);
+    out->literal[len - 1] = '\0';
+    out->literal_len = len - 1;
+    out->is_literal = 1;
+    choose_rare_pair(out);
+    if (opts->dfa_stats)
+      fprintf(stderr, "Literal search, no DFA\n");
+    if (opts->stats != NULL)
+      opts->stats->automaton = "literal";
+    return out;
+  }
+
+  // a table stored by an earlier run saves building the trie
+  if (opts->cache_dir != NULL && !opts->lazy) {
+    key = dfa_cache_key(patterns, len, 1, opts->minimize, &key_len);
+    out->table = dfa_cache_load(opts->cache_dir, key, key_len, opts->dfa_cache);
+    if (out->table != NULL) {
+      free(key);
+      if (opts->dfa_stats)
+        fprintf(stderr, "DFA states: %d, from the cache\n", out->table->num_states -
+            DFA_FIRST - (out->table->line_match != out->table->start));
+      if (opts->stats != NULL) {
+        opts->stats->automaton = "Aho-Corasick DFA from the cache";
+        opts->stats->dfa_states = out->table->num_states - DFA_FIRST;
+        opts->stats->num_classes = out->table->num_classes;
+      }
+      return out;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  trie = ac_build(patterns, len, &out->mem);
+  out->table = ac_new_table(patterns, len);
+  row = sizeof(uint32_t) << out->table->shift;
+  if (opts->stats != NULL) {
+    opts->stats->automaton = "Aho-Corasick DFA";
+    opts->stats->num_classes = out->table->num_classes;
+  }
+  if (opts->lazy || (size_t)(DFA_FIRST + trie->num_order) * row > opts->dfa_cache) {
+    lazy_dfa_new(out->table, NULL, trie, 0, opts->dfa_cache, &out->mem);
+    if (opts->stats != NULL)
+      opts->stats->automaton = "lazy Aho-Corasick DFA";
+  } else {
+    ac_flatten(out->table, trie, &scratch);
+    arena_reset(&scratch);
+    num_states = out->table->num_states - DFA_FIRST;
+    if (opts->stats != NULL)
+      opts->stats->dfa_states = num_states;
+    if (opts->minimize > 0 || (opts->minimize < 0 && num_states >= MINIMIZE_MIN)) {
+      dfa_minimize(out->table, &scratch);
+      if (opts->stats != NULL)
+        opts->stats->min_states = out->table->num_states - DFA_FIRST;
+    }
+    arena_free(&scratch);
+    dfa_add_newlines(out->table, 0);
+    if (key != NULL)
+      dfa_cache_store(opts->cache_dir, key, key_len, out->table);
+  }
+  free(key);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (opts->dfa_stats) {
+    fprintf(stderr, "Aho-Corasick: %d patterns, %u trie nodes, built in %.1f ms\n",
+        trie->num_patterns, trie->num_order,
+        (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    fprintf(stderr, "Byte classes: %d\n", out->table->num_classes);
+    if (out->table->lazy != NULL)
+      fprintf(stderr, "DFA states: built lazily, table at most %zu KiB\n",
+          opts->dfa_cache / 1024);
+    else
+      fprintf(stderr, "DFA states: %d, table: %zu KiB\n",
+          out->table->num_states - DFA_FIRST,
+          (out->table->num_states * (row + 2) + 1023) / 1024);
+  }
+  return out;
+}
+
+void RE_destroy(RE* re)
+{
+  if (re->table != NULL)
+    free_dfa_table(re->table);
+  arena_free(&re->mem);
+  free(re);
+}
+
+// Copy of the RE for another thread with a lazy DFA of its own, which starts
+// out empty. Everything else is shared with 're' and only read while searching.
+RE* RE_thread_copy(RE* re)
+{
+  RE* out = malloc(sizeof(RE));
+  lazy_dfa* lazy = re->table->lazy;
+
+  *out = *re;
+  out->mem = (arena){NULL, 0};
+  out->table = malloc(sizeof(dfa_table));
+  *out->table = *re->table; // the byte classes
+  lazy_dfa_new(out->table, lazy->nfa_in, lazy->trie, lazy->match_end,
+      lazy->budget, &out->mem);
+  return out;
+}
+
+// Run the DFA over the line once, reading every character at most once.
+// Unanchored regular expressions don't need to be restarted at every position
+// since their DFA already contains the search loop from add_search_loop.
+int RE_run(RE* re, const char* text, size_t len)
+{
+  if (re->is_literal)
+    return literal_run(re, text, len);
+
+  dfa_table* table = re->table;
+  uint32_t state = table->start;
+  uint32_t next;
+  const char* end = text + len;
+
+  // we are done as soon as we reach an end node, with $ the state after the
+  // last character may still accept
+  for (; text != end; text++) {
+    if (table->accept[state])
+      return 1;
+    next = table->trans[(state << table->shift) +
+      table->classes[(unsigned char)*text]];
+    if (next == DFA_UNKNOWN)
+      next = lazy_dfa_next(table, state, *text);
+    state = next;
+    if (state == DFA_DEAD)
+      return 0;
+  }
+  return table->accept_eol[state];
+}
+
+
+// Convert Non-deterministic Finite Automaton to Deterministic Finite Automaton
+// Every DFA node stands for a set of NFA nodes. Since the closure of each NFA
+// node over always edges is known from nfa_closures, the set reached on a
+// character is the union of the closures of the targets of its edges. All
+// bytes of a class of 'table' reach the same set, so it is only computed once
+// per class.
+// The DFA and everything needed to build it is allocated from 'mem'.
+// Returns NULL if the DFA would have more than max_nodes nodes or takes more
+// than DFA_EAGER_WORK words of sets to build, since states which blow up like
+// those of "a.a.a.a." are better built lazily only when the input needs them.
+// Either limit is reached within a few milliseconds, which is all that is
+// lost when the lazy DFA takes over.
+dfa* nfa_to_dfa(nfa* nfa_in, dfa_table* table, int max_nodes, arena* mem)
+{
+  dfa* out = arena_alloc(mem, sizeof(dfa));
+  int words = nfa_in->set_words;
+  int num_classes = table->num_classes;
+  // sets reached on each class of bytes
+  uint64_t* conns = arena_alloc(mem, sizeof(uint64_t) * words * num_classes);
+  uint8_t used[256];
+  unsigned char byte[256]; // a byte of each class
+  dfagen_set states = {NULL, 0, 0};
+
+  for (int c = 255; c >= 0; c--)
+    byte[table->classes[c]] = c;
+
+  // The start state is the only one which can be at the end of an empty
+  // line. If that makes it match where the same set of nodes reached within
+  // a line doesn't, it is left out of the hash table so that it stays a
+  // state of its own.
+  int empty_line = nfa_in->empty_line &&
+    !set_intersects(nfa_in->start_set, nfa_in->eol_ends, words);
+  dfagen_set start_only = {NULL, 0, 0};
+  dfagen_node* worklist = insert_into_dfagen_set(empty_line ? &start_only : &states,
+      nfa_in, nfa_in->start_set, hash_set(nfa_in->start_set, words), mem);
+  worklist->next = NULL;
+  worklist->node->iseol |= nfa_in->empty_line;
+
+  out->start = worklist->node;
+  out->num_nodes = 1;
+  out->num_edges = 0;
+  out->start->id = DFA_FIRST; // lower ids are special states of the table
+  dfa_node* curr_node;
+  dfagen_node* tmp;
+  const uint64_t* set;
+
+  nfa_edge* iter_edge;
+  uint64_t* conn;
+  uint32_t hash;
+  int c;
+  size_t work = 0;
+
+  while (worklist != NULL) {
+    if (out->num_nodes > max_nodes || work > DFA_EAGER_WORK)
+      return NULL;
+    curr_node = worklist->node;
+    set = worklist->set;
+    // remove first item from worklist queue, it stays in 'states'
+    worklist = worklist->next;
+
+    // loop over all nodes belonging to current dfa_node
+    memset(used, 0, sizeof(used));
+    for (int w = 0; w < words; w++) {
+      for (uint64_t bits = set[w]; bits != 0; bits &= bits - 1) {
+        int id = w * 64 + __builtin_ctzll(bits);
+        // loop over edges of the node, always edges are already part of the
+        // closures
+        for (iter_edge = nfa_in->nodes[id]->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+          if (iter_edge->bytes == NULL)
+            continue;
+          for (c = 0; c < num_classes; c++) {
+            if (!set_has(iter_edge->bytes, byte[c]))
+              continue;
+            conn = conns + (size_t)c * words;
+            if (!used[c]) {
+              used[c] = 1;
+              memset(conn, 0, sizeof(uint64_t) * words);
+            }
+            set_union(conn, nfa_in->closures + (size_t)iter_edge->node->id * words, words);
+            work += words;
+          }
+        }
+      }
+    }
+
+    // loop over the sets of nodes for each class with an edge
+    for (c = 0; c < num_classes; c++) {
+      if (!used[c])
+        continue;
+      conn = conns + (size_t)c * words;
+      hash = hash_set(conn, words);
+      work += words;
+      // add dfagen_node to worklist with this set of nfa_nodes
+      if ((tmp = find_dfagen_node(&states, conn, words, hash)) == NULL) {
+        tmp = insert_into_dfagen_set(&states, nfa_in, conn, hash, mem);
+        tmp->next = worklist;
+        worklist = tmp;
+        tmp->node->id = DFA_FIRST + out->num_nodes++;
+      }
+      curr_node->next_l = insert_dfa_edge(curr_node->next_l, c, tmp->node, mem);
+      out->num_edges++;
+    }
+  }
+
+  return out;
+}
+
+
+// Group the bytes into classes which no edge of the NFA tells apart and
+// create a table without any states whose rows have a column per class.
+// Starting from a single class, every set of bytes of an edge splits each
+// class which has bytes both in and outside of it. '\n' always has a class of
+// its own since dfa_add_newlines gives it a transition of its own.
+// The number of columns is rounded up to a power of two so the start of a
+// row is found with a shift.
+dfa_table* new_dfa_table(nfa* nfa_in)
+{
+  dfa_table* out = malloc(sizeof(dfa_table));
+  const uint64_t* last = NULL;
+  nfa_edge* iter_edge;
+  int inside[256]; // bytes of each class in the set
+  int size[256];   // bytes of each class
+  int split[256];  // class of the bytes of a split class in the set
+  int c;
+
+  memset(out->classes, 0, sizeof(out->classes));
+  memset(size, 0, sizeof(size));
+  out->num_classes = 1;
+  out->classes['\n'] = out->num_classes++;
+  size[0] = 255;
+  size[1] = 1;
+  for (int id = 0; id < nfa_in->num_nodes; id++) {
+    if (nfa_in->nodes[id] == NULL)
+      continue;
+    for (iter_edge = nfa_in->nodes[id]->next_l; iter_edge != NULL;
+        iter_edge = iter_edge->next) {
+      // the copies of a repetition share their sets
+      if (iter_edge->bytes == NULL || iter_edge->bytes == last)
+        continue;
+      last = iter_edge->bytes;
+      memset(inside, 0, sizeof(int) * out->num_classes);
+      for (c = 0; c < 256; c++)
+        inside[out->classes[c]] += set_has(last, c);
+      for (int k = out->num_classes - 1; k >= 0; k--)
+        split[k] = (inside[k] > 0 && inside[k] < size[k]) ? out->num_classes++ : -1;
+      for (c = 0; c < 256; c++) {
+        int k = out->classes[c];
+        if (split[k] >= 0 && set_has(last, c)) {
+          out->classes[c] = split[k];
+          size[k]--;
+          size[split[k]]++;
+        }
+      }
+    }
+  }
+  for (out->shift = 0; (1 << out->shift) < out->num_classes; out->shift++)
+    ;
+
+  out->num_states = 0;
+  out->trans = NULL;
+  out->accept = NULL;
+  out->accept_eol = NULL;
+  out->stop = NULL;
+  out->lazy = NULL;
+  out->map = NULL;
+  return out;
+}
+
+// Number the nodes of the DFA and store all of its edges in the table, so
+// that following an edge is a single indexed load instead of a walk over the
+// edge list. Columns without any edge lead to DFA_DEAD.
+void dfa_flatten(dfa_table* table, dfa* dfa_in, arena* scratch)
+{
+  dfa_table* out = table;
+  out->num_states = DFA_FIRST + dfa_in->num_nodes;
+  out->start = dfa_in->start->id;
+  out->trans = calloc((size_t)out->num_states << out->shift, sizeof(uint32_t));
+  out->accept = calloc(out->num_states, sizeof(uint8_t));
+  out->accept_eol = calloc(out->num_states, sizeof(uint8_t));
+
+  // breadth first walk over the graph, 'seen' is indexed by node id
+  dfa_node** queue = arena_alloc(scratch, sizeof(dfa_node*) * out->num_states);
+  uint8_t* seen = arena_calloc(scratch, out->num_states, sizeof(uint8_t));
+  int head = 0;
+  int tail = 0;
+  dfa_node* node;
+  dfa_edge* iter_edge;
+  uint32_t* row;
+
+  queue[tail++] = dfa_in->start;
+  seen[dfa_in->start->id] = 1;
+  while (head < tail) {
+    node = queue[head++];
+    row = out->trans + ((size_t)node->id << out->shift);
+    out->accept[node->id] = node->isend;
+    out->accept_eol[node->id] = node->iseol;
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      row[iter_edge->cls] = iter_edge->node->id;
+      if (!seen[iter_edge->node->id]) {
+        seen[iter_edge->node->id] = 1;
+        queue[tail++] = iter_edge->node;
+      }
+    }
+  }
+}
+
+
+// Merge equivalent states of the flattened DFA with Hopcroft's partition
+// refinement. The states start out split into accepting states, states which
+// only accept at the end of the line and other states and
+// a block of states is split whenever only some of them lead into the current
+// splitter block on a character. What is left are the blocks of states which
+// can't be told apart by any input, each becomes one state. States from which
+// no end node can be reached end up in the block of DFA_DEAD.
+// The '\n' column is ignored since dfa_add_newlines overwrites it anyway.
+// Since every column is a whole class of bytes the refinement only has to
+// look at num_classes characters.
+// All temporary arrays are allocated from 'scratch'.
+void dfa_minimize(dfa_table* table, arena* scratch)
+{
+  int n = table->num_states;
+  int shift = table->shift;
+  int num_classes = table->num_classes;
+  int nl = table->classes['\n'];
+  uint32_t* trans = table->trans;
+  // the states which lead to state t on class c are pred[pred_off[(t << shift)
+  // + c]] up to pred[pred_off[(t << shift) + c + 1] - 1]
+  uint32_t* pred_off = arena_calloc(scratch, ((size_t)n << shift) + 1, sizeof(uint32_t));
+  uint32_t* pred = arena_alloc(scratch, sizeof(uint32_t) * ((size_t)n << shift));
+  // the states of block b are elems[first[b]] up to elems[past[b] - 1], the
+  // first marked[b] of them lead into the splitter
+  int* elems = arena_alloc(scratch, sizeof(int) * n);
+  int* pos = arena_alloc(scratch, sizeof(int) * n); // of each state in elems
+  int* block = arena_alloc(scratch, sizeof(int) * n);
+  int* first = arena_alloc(scratch, sizeof(int) * n);
+  int* past = arena_alloc(scratch, sizeof(int) * n);
+  int* marked = arena_calloc(scratch, n, sizeof(int));
+  uint8_t* in_work = arena_calloc(scratch, n, sizeof(uint8_t));
+  int* work = arena_alloc(scratch, sizeof(int) * n);
+  int* touched = arena_alloc(scratch, sizeof(int) * n);
+  int* splitter = arena_alloc(scratch, sizeof(int) * n);
+  int num_blocks = 0;
+  int top = 0;
+  int len, num_touched, b, nb, s, k;
+  size_t t;
+
+  for (s = 0; s < n; s++)
+    for (int c = 0; c < num_classes; c++)
+      pred_off[((size_t)trans[((size_t)s << shift) + c] << shift) + c]++;
+  for (t = 1; t <= (size_t)n << shift; t++)
+    pred_off[t] += pred_off[t - 1];
+  for (s = n - 1; s >= 0; s--) // pred_off ends up at the start of each list
+    for (int c = 0; c < num_classes; c++)
+      pred[--pred_off[((size_t)trans[((size_t)s << shift) + c] << shift) + c]] = s;
+
+  // DFA_UNKNOWN is never entered and stays on its own
+  k = 0;
+  for (int group = 0; group < 4; group++) {
+    first[num_blocks] = k;
+    for (s = 0; s < n; s++) {
+      if (group == (s == DFA_UNKNOWN ? 0 : table->accept[s] ? 1 :
+            table->accept_eol[s] ? 2 : 3)) {
+        elems[k] = s;
+        pos[s] = k++;
+        block[s] = num_blocks;
+      }
+    }
+    if (k > first[num_blocks]) {
+      past[num_blocks] = k;
+      in_work[num_blocks] = 1;
+      work[top++] = num_blocks++;
+    }
+  }
+
+  while (top > 0) {
+    b = work[--top];
+    in_work[b] = 0;
+    // the block may be split while it is used as the splitter
+    len = past[b] - first[b];
+    memcpy(splitter, elems + first[b], sizeof(int) * len);
+    for (int c = 0; c < num_classes; c++) {
+      if (c == nl)
+        continue;
+      // move the states leading into the splitter to the front of their block
+      num_touched = 0;
+      for (int i = 0; i < len; i++) {
+        t = ((size_t)splitter[i] << shift) + c;
+        for (uint32_t j = pred_off[t]; j < pred_off[t + 1]; j++) {
+          s = pred[j];
+          nb = block[s];
+          k = first[nb] + marked[nb];
+          elems[pos[s]] = elems[k];
+          pos[elems[k]] = pos[s];
+          elems[k] = s;
+          pos[s] = k;
+          if (marked[nb]++ == 0)
+            touched[num_touched++] = nb;
+        }
+      }
+      // split off the marked states unless they are the whole block
+      for (int i = 0; i < num_touched; i++) {
+        b = touched[i];
+        if (marked[b] == past[b] - first[b]) {
+          marked[b] = 0;
+          continue;
+        }
+        nb = num_blocks++;
+        first[nb] = first[b];
+        past[nb] = first[b] + marked[b];
+        first[b] = past[nb];
+        marked[b] = marked[nb] = 0;
+        for (k = first[nb]; k < past[nb]; k++)
+          block[elems[k]] = nb;
+        // both halves have to split the others if b was still to be used,
+        // otherwise it is enough to use the smaller one
+        if (in_work[b] || past[nb] - first[nb] <= past[b] - first[b]) {
+          in_work[nb] = 1;
+          work[top++] = nb;
+        } else {
+          in_work[b] = 1;
+          work[top++] = b;
+        }
+      }
+    }
+  }
+
+  // one state per block, keeping the ids of the special states
+  int* new_id = arena_alloc(scratch, sizeof(int) * num_blocks);
+  int num_states = DFA_FIRST;
+  for (b = 0; b < num_blocks; b++)
+    new_id[b] = -1;
+  new_id[block[DFA_DEAD]] = DFA_DEAD;
+  new_id[block[DFA_UNKNOWN]] = DFA_UNKNOWN;
+  for (b = 0; b < num_blocks; b++)
+    if (new_id[b] < 0)
+      new_id[b] = num_states++;
+
+  uint32_t* new_trans = calloc((size_t)num_states << shift, sizeof(uint32_t));
+  uint8_t* new_accept = malloc(num_states);
+  uint8_t* new_accept_eol = malloc(num_states);
+  for (b = 0; b < num_blocks; b++) {
+    s = elems[first[b]];
+    for (int c = 0; c < num_classes; c++)
+      new_trans[((size_t)new_id[b] << shift) + c] =
+        new_id[block[trans[((size_t)s << shift) + c]]];
+    new_accept[new_id[b]] = table->accept[s];
+    new_accept_eol[new_id[b]] = table->accept_eol[s];
+  }
+  table->start = new_id[block[table->start]];
+  table->num_states = num_states;
+  free(table->trans);
+  free(table->accept);
+  free(table->accept_eol);
+  table->trans = new_trans;
+  table->accept = new_accept;
+  table->accept_eol = new_accept_eol;
+}
+
+
+// Let '\n' lead from every state back to the start state, so that the DFA
+// can be run over a whole buffer of lines at once, and mark the states at
+// which the scan over the buffer has to stop in 'stop'.
+// These are the accepting states, after which the line matches whatever
+// follows. With $ a line also matches if a state which accepts at the end of
+// the line is followed by '\n', which instead leads to the extra state
+// 'line_match'. It behaves exactly like the start state but tells the scan
+// that the line which just ended matched.
+// DFA_DEAD stops the scan as well so that the rest of the line can be
+// skipped.
+void dfa_add_newlines(dfa_table* table, int match_end)
+{
+  uint32_t s;
+  size_t row = sizeof(uint32_t) << table->shift;
+  int nl = table->classes['\n'];
+  table->line_match = table->start;
+  if (match_end) {
+    table->line_match = table->num_states++;
+    table->trans = realloc(table->trans, row * table->num_states);
+    table->accept = realloc(table->accept, table->num_states);
+    table->accept_eol = realloc(table->accept_eol, table->num_states);
+    memcpy(table->trans + ((size_t)table->line_match << table->shift),
+        table->trans + ((size_t)table->start << table->shift), row);
+    table->accept[table->line_match] = table->accept[table->start];
+    table->accept_eol[table->line_match] = table->accept_eol[table->start];
+  }
+
+  table->stop = calloc(table->num_states, sizeof(uint8_t));
+  for (s = 0; s < (uint32_t)table->num_states; s++) {
+    if (match_end && table->accept_eol[s])
+      table->trans[(s << table->shift) + nl] = table->line_match;
+    else
+      table->trans[(s << table->shift) + nl] = table->start;
+    table->stop[s] = table->accept[s];
+  }
+  table->stop[DFA_DEAD] = 1;
+  table->stop[DFA_UNKNOWN] = 1;
+  table->stop[table->line_match] |= match_end;
+}
+
+
+// Whether the regex is just a string, apart from a ^ in front of it and a $
+// after it
+int is_literal_regex(const char* regex, size_t len)
+{
+  size_t first = (len > 0 && regex[0] == '^');
+  size_t past = (len > first && regex[len - 1] == '$') ? len - 1 : len;
+
+  if (past == first)
+    return 0;
+  for (size_t i = first; i < past; i++) {
+    if (strchr(".[()*+?{|\\^$\n", regex[i]) != NULL)
+      return 0;
+  }
+  return 1;
+}
+
+// Whether the '\n' separated patterns are all just strings, so that they match
+// the same as with -F
+int literal_lines(const char* patterns, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    if (strchr(".[()*+?{|\\^$", patterns[i]) != NULL)
+      return 0;
+  }
+  return 1;
+}
+
+// Find the longest string which every match of the regex has to contain: the
+// longest run of characters which are neither optional nor anything but a
+// single character, like '.', a class or a group. Groups are skipped as a
+// whole. A character which is repeated ends the run after it and starts the
+// next one, "ab+c" has to contain "ab" and "bc". Alternatives at the top
+// level have no such string in common.
+// Writes the string to 'out' and returns its length.
+size_t required_literal(const char* regex, char* out)
+{
+  char* run = malloc(strlen(regex) + 1);
+  const char* p = regex;
+  const char* q;
+  uint64_t bytes[4];
+  size_t len = 0;
+  size_t best = 0;
+  size_t bound;
+  int c;        // character of the atom at p, -1 if it is none
+  int optional; // one of its repetitions allows 0 of it
+  int repeated; // one allows more than 1
+  int depth;
+  int min;
+  int max;
+
+  while (*p != '\0') {
+    if (*p == '|' || *p == '\n') {
+      best = 0;
+      break;
+    }
+    c = -1;
+    if (*p == '*' || *p == '+' || *p == '?' ||
+        (*p == '{' && parse_bound(p, &min, &max) > 0)) {
+      // repeats nothing, like in generate_nfa
+    } else if (*p == '(') {
+      for (depth = 0; *p != '\0'; p++) {
+        q = p + 1;
+        if (*p == '\\' && p[1] != '\0')
+          p++;
+        else if (*p == '[' && parse_class(&q, bytes) == NULL)
+          p = q - 1;
+        else if (*p == '(')
+          depth++;
+        else if (*p == ')' && --depth == 0)
+          break;
+      }
+      p += (*p != '\0');
+    } else if (*p == '[') {
+      p++;
+      if (parse_class(&p, bytes) != NULL)
+        p += strlen(p); // invalid, generate_nfa will tell
+    } else if (*p == '\\') {
+      if (p[1] != '\0' && !parse_escape(p[1], bytes))
+        c = (unsigned char)p[1];
+      p += 1 + (p[1] != '\0');
+    } else if (*p == '.' || *p == '^' || *p == '$') {
+      p++;
+    } else {
+      c = (unsigned char)*p++;
+    }
+
+    optional = 0;
+    repeated = 0;
+    for (;;) {
+      if (*p == '*' || *p == '?') {
+        optional = 1;
+        bound = 1;
+      } else if (*p == '+') {
+        repeated = 1;
+        bound = 1;
+      } else if (*p == '{' && (bound = parse_bound(p, &min, &max)) > 0) {
+        optional |= (min == 0);
+        repeated |= (max != 1);
+      } else {
+        break;
+      }
+      p += bound;
+    }
+
+    if (c < 0 || optional) {
+      len = 0;
+      continue;
+    }
+    run[len++] = c;
+    if (len > best) {
+      best = len;
+      memcpy(out, run, len);
+    }
+    if (repeated) {
+      run[0] = c;
+      len = 1;
+    }
+  }
+  out[best] = '\0';
+  free(run);
+  return best;
+}
+
+// LAZY DFA
+
+// Instead of converting the whole NFA up front only the start state is built
+// here. lazy_dfa_next adds the other states when the scan first needs them,
+// so compiling costs next to nothing and states which are never reached are
+// never built. Once the states use more than 'budget' bytes all of them are
+// thrown away and built again when needed, which bounds the memory used even
+// for regular expressions whose full DFA would be exponentially large.
+// The states of -F come from the nodes of 'trie' instead, 'nfa_in' is NULL
+// then.
+// Apart from the table everything is allocated from 'mem'.
+void lazy_dfa_new(dfa_table* table, nfa* nfa_in, ac_trie* trie, int match_end, size_t budget, arena* mem)
+{
+  dfa_table* out = table;
+  lazy_dfa* lazy = arena_alloc(mem, sizeof(lazy_dfa));
+  int words = (trie != NULL) ? 1 : nfa_in->set_words;
+
+  lazy->nfa_in = nfa_in;
+  lazy->trie = trie;
+  lazy->words = words;
+  lazy->match_end = match_end;
+  lazy->budget = budget;
+  lazy->used = 0;
+  lazy->flushes = 0;
+
+  // the table is never grown beyond what the budget allows for, apart from
+  // the two start states and one more state which always have to fit
+  lazy->max_states = DFA_FIRST + 3 +
+    budget / ((sizeof(uint32_t) << out->shift) + sizeof(uint64_t) * words);
+  out->trans = malloc((sizeof(uint32_t) << out->shift) * (size_t)lazy->max_states);
+  out->accept = malloc(lazy->max_states);
+  out->accept_eol = malloc(lazy->max_states);
+  out->stop = malloc(lazy->max_states);
+  lazy->sets = arena_alloc(mem, sizeof(uint64_t) * words * (size_t)lazy->max_states);
+  lazy->hash_next = arena_alloc(mem, sizeof(int) * lazy->max_states);
+  for (lazy->num_buckets = 64; lazy->num_buckets < lazy->max_states;
+      lazy->num_buckets *= 2)
+    ;
+  lazy->buckets = arena_alloc(mem, sizeof(int) * lazy->num_buckets);
+  lazy->scratch = arena_alloc(mem, sizeof(uint64_t) * words);
+
+  out->num_states = 0;
+  out->lazy = lazy;
+  lazy_dfa_flush(out);
+}
+
+// Throw away all states and add the start states again. They get the same
+// ids as before so the scan can keep using them.
+void lazy_dfa_flush(dfa_table* table)
+{
+  lazy_dfa* lazy = table->lazy;
+  nfa* nfa_in = lazy->nfa_in;
+  const uint64_t root = 0;
+  const uint64_t* start_set = (lazy->trie != NULL) ? &root : nfa_in->start_set;
+
+  if (table->num_states > 0)
+    lazy->flushes++;
+  lazy->used = 0;
+  for (int i = 0; i < lazy->num_buckets; i++)
+    lazy->buckets[i] = -1;
+
+  // DFA_DEAD is only left through '\n', DFA_UNKNOWN is never entered
+  for (int c = 0; c < table->num_classes; c++) {
+    table->trans[(DFA_DEAD << table->shift) + c] = DFA_DEAD;
+    table->trans[(DFA_UNKNOWN << table->shift) + c] = DFA_UNKNOWN;
+  }
+  table->trans[(DFA_DEAD << table->shift) + table->classes['\n']] = DFA_FIRST;
+  table->accept[DFA_DEAD] = table->accept[DFA_UNKNOWN] = 0;
+  table->accept_eol[DFA_DEAD] = table->accept_eol[DFA_UNKNOWN] = 0;
+  table->stop[DFA_DEAD] = table->stop[DFA_UNKNOWN] = 1;
+  table->num_states = DFA_FIRST;
+  table->start = DFA_FIRST;
+  table->line_match = lazy->match_end ? DFA_FIRST + 1 : DFA_FIRST;
+
+  // like in nfa_to_dfa, a start state which only matches at the end of an
+  // empty line can't be found by its set
+  int empty_line = nfa_in != NULL && nfa_in->empty_line &&
+    !set_intersects(start_set, nfa_in->eol_ends, lazy->words);
+  lazy_dfa_add_state(table, start_set, !empty_line);
+  if (lazy->match_end) { // same set as the start state but a different id
+    lazy_dfa_add_state(table, start_set, 0);
+    table->stop[table->line_match] = 1;
+  }
+  for (uint32_t s = table->start; empty_line && s <= table->line_match; s++) {
+    table->accept_eol[s] = 1;
+    table->trans[(s << table->shift) + table->classes['\n']] = table->line_match;
+  }
+}
+
+// Compute the state which 'state' leads to on character c and store it in the
+// table, where it is used for the whole class of c. If the cache had to be
+// flushed for it 'state' itself is gone and the transition is only returned.
+uint32_t lazy_dfa_next(dfa_table* table, uint32_t state, unsigned char c)
+{
+  lazy_dfa* lazy = table->lazy;
+  nfa* nfa_in = lazy->nfa_in;
+  int words = lazy->words;
+  const uint64_t* set = lazy->sets + (size_t)state * words;
+  int flushes = lazy->flushes;
+  nfa_edge* iter_edge;
+  uint32_t next;
+
+  memset(lazy->scratch, 0, sizeof(uint64_t) * words);
+  if (lazy->trie != NULL) // the state's one node of the trie
+    lazy->scratch[0] = ac_next(lazy->trie, set[0], c);
+  for (int w = 0; nfa_in != NULL && w < words; w++) {
+    for (uint64_t bits = set[w]; bits != 0; bits &= bits - 1) {
+      int id = w * 64 + __builtin_ctzll(bits);
+      for (iter_edge = nfa_in->nodes[id]->next_l; iter_edge != NULL;
+          iter_edge = iter_edge->next) {
+        if (iter_edge->bytes != NULL && set_has(iter_edge->bytes, c))
+          set_union(lazy->scratch,
+              nfa_in->closures + (size_t)iter_edge->node->id * words, words);
+      }
+    }
+  }
+
+  next = lazy_dfa_add_state(table, lazy->scratch, 1);
+  if (lazy->flushes == flushes)
+    table->trans[(state << table->shift) + table->classes[c]] = next;
+  return next;
+}
+
+// Look up the state for the set of NFA nodes and add it if it doesn't exist
+// yet. States which are not 'hashed' can't be found again.
+uint32_t lazy_dfa_add_state(dfa_table* table, const uint64_t* set, int hashed)
+{
+  lazy_dfa* lazy = table->lazy;
+  nfa* nfa_in = lazy->nfa_in;
+  int words = lazy->words;
+  uint32_t h = hash_set(set, words) & (lazy->num_buckets - 1);
+  size_t size = (sizeof(uint32_t) << table->shift) + 3 + sizeof(uint64_t) * words +
+    sizeof(int);
+  uint32_t s;
+  int isend;
+  int iseol;
+
+  if (nfa_in != NULL && set_is_empty(set, words))
+    return DFA_DEAD; // the trie always goes on from its root
+  if (hashed) {
+    for (int i = lazy->buckets[h]; i >= 0; i = lazy->hash_next[i]) {
+      if (memcmp(lazy->sets + (size_t)i * words, set, sizeof(uint64_t) * words) == 0)
+        return i;
+    }
+  }
+
+  // the start states and one more state always have to fit
+  if (table->num_states > (int)table->line_match + 1 &&
+      (lazy->used + size > lazy->budget || table->num_states == lazy->max_states)) {
+    // 'set' is either lazy->scratch or a closure, neither is touched by the
+    // flush
+    lazy_dfa_flush(table);
+    return lazy_dfa_add_state(table, set, hashed);
+  }
+
+  s = table->num_states++;
+  lazy->used += size;
+  memcpy(lazy->sets + (size_t)s * words, set, sizeof(uint64_t) * words);
+  if (hashed) {
+    lazy->hash_next[s] = lazy->buckets[h];
+    lazy->buckets[h] = s;
+  }
+
+  if (lazy->trie != NULL) {
+    isend = lazy->trie->nodes[set[0]].isend;
+    iseol = isend;
+  } else {
+    isend = set_intersects(set, nfa_in->ends, words);
+    iseol = set_intersects(set, nfa_in->eol_ends, words);
+  }
+  for (int c = 0; c < table->num_classes; c++)
+    table->trans[(s << table->shift) + c] = DFA_UNKNOWN;
+  table->accept[s] = isend;
+  table->accept_eol[s] = iseol;
+  table->stop[s] = isend;
+  // '\n' leads to the start of the next line, see dfa_add_newlines
+  if (lazy->match_end && iseol)
+    table->trans[(s << table->shift) + table->classes['\n']] = table->line_match;
+  else
+    table->trans[(s << table->shift) + table->classes['\n']] = table->start;
+  return s;
+}
+
+
+// AHO-CORASICK
+
+// Put the '\n' separated patterns into a trie and link every node to the node
+// of its longest proper suffix in the trie, breadth first so that the links of
+// all shorter nodes are known. Following the links where a node has no child
+// for the next byte finds all patterns in one pass over the input.
+// The patterns are sorted first, so each one only shares a prefix with the
+// one before it and is added without looking up any child. The trie is then
+// numbered breadth first, which puts the children of each node next to each
+// other for ac_child.
+// The trie has at most one node per byte of the patterns, so that much memory
+// is all it takes. Everything but temporary arrays is allocated from 'mem'.
+ac_trie* ac_build(const char* patterns, size_t len, arena* mem)
+{
+  ac_trie* out = arena_alloc(mem, sizeof(ac_trie));
+  const char* end = patterns + len;
+  const char** sorted;
+  // the trie while it is built, each node has a list of its children
+  uint32_t* first = calloc(len + 1, sizeof(uint32_t));
+  uint32_t* sibling = malloc(sizeof(uint32_t) * (len + 1));
+  unsigned char* bytes = calloc(len + 1, 1);
+  uint8_t* ends = calloc(len + 1, 1);
+  uint32_t* path = malloc(sizeof(uint32_t) * (len + 1)); // nodes of 'prev'
+  const char* prev = "\n";
+  uint32_t num_nodes = 1;
+  size_t lcp;
+  size_t d;
+  size_t end_depth = SIZE_MAX; // of the first end node on 'path'
+  uint32_t node;
+  uint32_t child;
+  ac_node* n;
+
+  out->num_patterns = 0;
+  for (const char* p = patterns; p != end; p = memchr(p, '\n', end - p) + 1)
+    out->num_patterns++;
+  sorted = malloc(sizeof(char*) * (out->num_patterns + 1));
+  out->num_patterns = 0;
+  for (const char* p = patterns; p != end; p = memchr(p, '\n', end - p) + 1)
+    sorted[out->num_patterns++] = p;
+  qsort(sorted, out->num_patterns, sizeof(char*), ac_pattern_cmp);
+
+  path[0] = 0;
+  for (int i = 0; i < out->num_patterns; i++) {
+    for (lcp = 0; prev[lcp] != '\n' && prev[lcp] == sorted[i][lcp]; lcp++)
+      ;
+    // shorter patterns come first, so if one is a prefix of this one its end
+    // node is on 'path'
+    if (end_depth <= lcp)
+      continue;
+    for (d = lcp; sorted[i][d] != '\n'; d++) {
+      node = num_nodes++;
+      sibling[node] = 0;
+      bytes[node] = sorted[i][d];
+      if (d == lcp && first[path[d]] != 0)
+        sibling[path[d + 1]] = node; // after the children of earlier patterns
+      else
+        first[path[d]] = node;
+      path[d + 1] = node;
+    }
+    ends[path[d]] = 1;
+    end_depth = d;
+    prev = sorted[i];
+  }
+  free(sorted);
+
+  // number the nodes breadth first, 'path' becomes the queue of the old ids
+  out->nodes = arena_alloc(mem, sizeof(ac_node) * num_nodes);
+  out->num_nodes = num_nodes;
+  path[0] = 0;
+  out->num_order = 1;
+  for (node = 0; node < out->num_order; node++) {
+    n = &out->nodes[node];
+    n->child = out->num_order;
+    n->num_children = 0;
+    n->c = bytes[path[node]];
+    n->isend = ends[path[node]];
+    for (child = first[path[node]]; child != 0; child = sibling[child]) {
+      path[out->num_order++] = child;
+      n->num_children++;
+    }
+  }
+  free(first);
+  free(sibling);
+  free(bytes);
+  free(ends);
+  free(path);
+
+  // a node ends a pattern if its suffix does, its children are left out then
+  out->order = arena_alloc(mem, sizeof(uint32_t) * num_nodes);
+  out->order[0] = 0;
+  out->nodes[0].fail = 0;
+  out->num_order = 1;
+  for (uint32_t head = 0; head < out->num_order; head++) {
+    node = out->order[head];
+    for (child = out->nodes[node].child;
+        child < out->nodes[node].child + out->nodes[node].num_children; child++) {
+      n = &out->nodes[child];
+      n->fail = (node == 0) ? 0 : ac_next(out, out->nodes[node].fail, n->c);
+      if (out->nodes[n->fail].isend) {
+        n->isend = 1;
+        n->num_children = 0;
+      }
+      out->order[out->num_order++] = child;
+    }
+  }
+  return out;
+}
+
+// qsort comparison of two patterns which end with '\n', a pattern comes
+// before the longer ones which start with it
+int ac_pattern_cmp(const void* a, const void* b)
+{
+  const unsigned char* p = *(const unsigned char* const*)a;
+  const unsigned char* q = *(const unsigned char* const*)b;
+
+  for (; *p != '\n' && *p == *q; p++, q++)
+    ;
+  if (*p == '\n' || *q == '\n')
+    return (*p != '\n') - (*q != '\n');
+  return *p - *q;
+}
+
+// Child of the node for byte c, 0 if it has none. The children are sorted by
+// their byte and the root can have up to 256 of them.
+uint32_t ac_child(ac_trie* trie, uint32_t node, unsigned char c)
+{
+  uint32_t lo = trie->nodes[node].child;
+  uint32_t end = lo + trie->nodes[node].num_children;
+  uint32_t hi = end;
+  uint32_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (trie->nodes[mid].c < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < end && trie->nodes[lo].c == c) ? lo : 0;
+}
+
+// Node which the trie goes to from 'node' on byte c: its child or else the
+// child of the longest suffix which has one
+uint32_t ac_next(ac_trie* trie, uint32_t node, unsigned char c)
+{
+  uint32_t child;
+
+  for (;;) {
+    if ((child = ac_child(trie, node, c)) != 0 || node == 0)
+      return child;
+    node = trie->nodes[node].fail;
+  }
+}
+
+// Table for the trie with a class for '\n' and for each byte of the patterns,
+// all other bytes lead back to the root, see new_dfa_table
+dfa_table* ac_new_table(const char* patterns, size_t len)
+{
+  dfa_table* out = malloc(sizeof(dfa_table));
+
+  memset(out->classes, 0, sizeof(out->classes));
+  out->num_classes = 1;
+  out->classes['\n'] = out->num_classes++;
+  for (size_t i = 0; i < len; i++) {
+    if (out->classes[(unsigned char)patterns[i]] == 0)
+      out->classes[(unsigned char)patterns[i]] = out->num_classes++;
+  }
+  for (out->shift = 0; (1 << out->shift) < out->num_classes; out->shift++)
+    ;
+
+  out->num_states = 0;
+  out->trans = NULL;
+  out->accept = NULL;
+  out->accept_eol = NULL;
+  out->stop = NULL;
+  out->lazy = NULL;
+  out->map = NULL;
+  return out;
+}
+
+// Store the transitions of every node of the trie in the table, the same way
+// dfa_flatten does for a DFA. The row of a node starts out as a copy of the
+// row of its suffix, which comes earlier breadth first, and then gets the
+// edges to its children.
+void ac_flatten(dfa_table* table, ac_trie* trie, arena* scratch)
+{
+  dfa_table* out = table;
+  size_t row = sizeof(uint32_t) << out->shift;
+  uint32_t* state = arena_alloc(scratch, sizeof(uint32_t) * trie->num_nodes);
+  uint32_t* trans;
+  uint32_t node;
+  uint32_t child;
+
+  out->num_states = DFA_FIRST + trie->num_order;
+  out->start = DFA_FIRST;
+  out->trans = calloc((size_t)out->num_states << out->shift, sizeof(uint32_t));
+  out->accept = calloc(out->num_states, sizeof(uint8_t));
+  for (uint32_t i = 0; i < trie->num_order; i++)
+    state[trie->order[i]] = DFA_FIRST + i;
+
+  for (uint32_t i = 0; i < trie->num_order; i++) {
+    node = trie->order[i];
+    trans = out->trans + ((size_t)state[node] << out->shift);
+    if (node == 0) {
+      for (int c = 0; c < out->num_classes; c++)
+        trans[c] = out->start;
+    } else {
+      memcpy(trans, out->trans + ((size_t)state[trie->nodes[node].fail] << out->shift), row);
+    }
+    for (child = trie->nodes[node].child;
+        child < trie->nodes[node].child + trie->nodes[node].num_children; child++)
+      trans[out->classes[trie->nodes[child].c]] = state[child];
+    out->accept[state[node]] = trie->nodes[node].isend;
+  }
+  // a pattern matches wherever in the line it ends
+  out->accept_eol = malloc(out->num_states);
+  memcpy(out->accept_eol, out->accept, out->num_states);
+}
+
+
+// Generate Non-deterministic Finite Automaton for given regular expression
+// The nodes are numbered with consecutive ids starting at *next_id. Patterns
+// on lines of their own, as -f gives them, are alternatives like with '|'.
+// Returns NULL and prints why if the regular expression is invalid.
+nfa* generate_nfa(const char* regex, int* next_id, arena* mem) {
+  regex_parser rp = {regex, 0, next_id, mem, NULL, 0, NULL};
+  int first_id = *next_id;
+  nfa* out_nfa;
+
+  rp.any = arena_alloc(mem, sizeof(uint64_t) * 4);
+  memset(rp.any, 0xff, sizeof(uint64_t) * 4);
+  rp.any['\n' / 64] &= ~((uint64_t)1 << ('\n' % 64)); // lines never contain it
+
+  out_nfa = parse_alt(&rp);
+  if (rp.error == NULL && *next_id - first_id > NFA_MAX_NODES)
+    rp.error = "regular expression too big";
+  if (rp.error != NULL) {
+    if (strchr(regex, '\n') != NULL) // the lines of -f, too many to repeat
+      fprintf(stderr, "Invalid regular expressions in the pattern file: %s\n",
+          rp.error);
+    else
+      fprintf(stderr, "Invalid regular expression '%s': %s\n", regex, rp.error);
+    return NULL;
+  }
+  out_nfa->end->isend = 1;
+  out_nfa->num_nodes = *next_id - first_id;
+  out_nfa->has_eol = rp.has_eol;
+  return out_nfa;
+}
+
+// alternatives := sequence ('|' sequence)*
+nfa* parse_alt(regex_parser* rp)
+{
+  nfa* out = parse_concat(rp);
+
+  while (rp->error == NULL &&
+      (*rp->p == '|' || (*rp->p == '\n' && rp->depth == 0))) {
+    rp->p++;
+    out = nfa_alt(rp, out, parse_concat(rp));
+  }
+  return out;
+}
+
+// sequence := repetition*, which may be empty like in "()" or "a|"
+nfa* parse_concat(regex_parser* rp)
+{
+  nfa* out = NULL;
+  nfa* next;
+
+  while (rp->error == NULL && *rp->p != '\0' && *rp->p != '|' &&
+      *rp->p != '\n' && !(*rp->p == ')' && rp->depth > 0)) {
+    next = parse_repeat(rp);
+    out = (out == NULL) ? next : nfa_concat(rp, out, next);
+  }
+  if (out == NULL)
+    out = nfa_fragment(rp, NULL, 0);
+  return out;
+}
+
+// repetition := atom ('*' | '+' | '?' | '{m,n}')*
+nfa* parse_repeat(regex_parser* rp)
+{
+  int first_id = *rp->next_id; // the atom gets the ids from here on
+  nfa* out = parse_atom(rp);
+  int min;
+  int max;
+  size_t len;
+
+  while (rp->error == NULL) {
+    if (*rp->p == '*') {
+      min = 0;
+      max = -1;
+      len = 1;
+    } else if (*rp->p == '+') {
+      min = 1;
+      max = -1;
+      len = 1;
+    } else if (*rp->p == '?') {
+      min = 0;
+      max = 1;
+      len = 1;
+    } else if (*rp->p != '{' || (len = parse_bound(rp->p, &min, &max)) == 0) {
+      break; // '{' which doesn't start a valid bound is just a character
+    }
+    if (max >= 0 && min > max) {
+      rp->error = "minimum of {m,n} larger than maximum";
+    } else if (min > REPEAT_MAX || max > REPEAT_MAX) {
+      rp->error = "too many repetitions";
+    } else {
+      rp->p += len;
+      out = nfa_repeat(rp, out, first_id, min, max);
+    }
+  }
+  return out;
+}
+
+// atom := character | '\' character | '.' | class | '^' | '$'
+//         | '(' alternatives ')'
+nfa* parse_atom(regex_parser* rp)
+{
+  char c = *rp->p;
+  uint64_t* bytes;
+  nfa* out;
+  int min;
+  int max;
+
+  // like grep a repetition without anything before it repeats nothing, also
+  // a bound like "{1}" at the start
+  if (c == '*' || c == '+' || c == '?' ||
+      (c == '{' && parse_bound(rp->p, &min, &max) != 0))
+    return nfa_fragment(rp, NULL, 0);
+  rp->p++;
+  if (c == '(') {
+    rp->depth++;
+    out = parse_alt(rp);
+    rp->depth--;
+    if (rp->error == NULL && *rp->p != ')')
+      rp->error = "unmatched (";
+    if (rp->error == NULL)
+      rp->p++;
+    return out;
+  }
+  if (c == '.')
+    return nfa_fragment(rp, rp->any, 0);
+  if (c == '^' || c == '$') {
+    rp->has_eol |= (c == '$');
+    return nfa_fragment(rp, NULL, c);
+  }
+
+  bytes = arena_calloc(rp->mem, 4, sizeof(uint64_t));
+  if (c == '[') {
+    rp->error = parse_class(&rp->p, bytes);
+  } else if (c == '\\' && *rp->p == '\0') {
+    rp->error = "trailing backslash";
+  } else if (c == '\\' && strchr("bB<>`'123456789", *rp->p) != NULL) {
+    // word boundaries and back-references, which a DFA can't match
+    rp->error = "unsupported escape";
+  } else if (c == '\\') {
+    if (!parse_escape(*rp->p, bytes))
+      set_add(bytes, (unsigned char)*rp->p);
+    rp->p++;
+  } else {
+    set_add(bytes, (unsigned char)c);
+  }
+  return nfa_fragment(rp, bytes, 0);
+}
+
+// Add the bytes of the bracket expression at *p, which follows the '[', to
+// 'bytes' and move *p past its ']'.
+// Returns why it is invalid, NULL if it isn't.
+const char* parse_class(const char** p, uint64_t* bytes)
+{
+  static const struct {
+    const char* name;
+    int (*is)(int c);
+  } names[] = {{"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+    {"upper", isupper}, {"lower", islower}, {"space", isspace},
+    {"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+    {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit}};
+  const unsigned char* s = (const unsigned char*)*p;
+  int negate = (*s == '^');
+  const char* name_end;
+  size_t len;
+  size_t i;
+  int c;
+
+  s += negate;
+  // a ']' right at the start is part of the class
+  for (const unsigned char* first = s; *s != ']' || s == first; ) {
+    if (*s == '\0')
+      return "unmatched [";
+    if (s[0] == '[' && s[1] == ':') {
+      name_end = strstr((const char*)s + 2, ":]");
+      if (name_end == NULL)
+        return "unmatched [";
+      len = name_end - (const char*)s - 2;
+      for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == len &&
+            memcmp(names[i].name, s + 2, len) == 0)
+          break;
+      }
+      if (i == sizeof(names) / sizeof(names[0]))
+        return "invalid character class name";
+      for (c = 0; c < 256; c++) {
+        if (names[i].is(c))
+          set_add(bytes, c);
+      }
+      s = (const unsigned char*)name_end + 2;
+      // a class can't be the start of a range
+      if (s[0] == '-' && s[1] != ']' && s[1] != '\0')
+        return "invalid range end";
+    } else if (s[1] == '-' && s[2] != ']' && s[2] != '\0') {
+      if (s[2] < s[0])
+        return "invalid range end";
+      for (c = s[0]; c <= s[2]; c++)
+        set_add(bytes, c);
+      s += 3;
+    } else {
+      set_add(bytes, *s++);
+    }
+  }
+  *p = (const char*)s + 1;
+
+  if (negate) {
+    for (i = 0; i < 4; i++)
+      bytes[i] = ~bytes[i];
+  }
+  bytes['\n' / 64] &= ~((uint64_t)1 << ('\n' % 64));
+  return NULL;
+}
+
+// Add the bytes of \w, \W, \s or \S to 'bytes'.
+// Returns 0 if c is none of them, the escaped character then stands for itself.
+int parse_escape(char c, uint64_t* bytes)
+{
+  int lower = c | 0x20;
+
+  if (lower != 'w' && lower != 's')
+    return 0;
+  for (int b = 0; b < 256; b++) {
+    int in = (lower == 'w') ? (isalnum(b) || b == '_') : (isspace(b) != 0);
+    if (in == (c == lower) && b != '\n')
+      set_add(bytes, b);
+  }
+  return 1;
+}
+
+// Read the bound {m}, {m,}, {,n} or {m,n} at p into min and max, where a
+// missing maximum is -1. Counts above REPEAT_MAX are cut to REPEAT_MAX + 1.
+// Returns the length of the bound, 0 if p doesn't start one.
+size_t parse_bound(const char* p, int* min, int* max)
+{
+  const char* s = p + 1;
+  char* num_end;
+  long num;
+
+  if (*s != ',' && (*s < '0' || *s > '9'))
+    return 0;
+  num = strtol(s, &num_end, 10); // 0 for "{,n}"
+  *min = (num > REPEAT_MAX) ? REPEAT_MAX + 1 : num;
+  *max = *min;
+  s = num_end;
+  if (*s == ',') {
+    s++;
+    *max = -1;
+    if (*s >= '0' && *s <= '9') {
+      num = strtol(s, &num_end, 10);
+      *max = (num > REPEAT_MAX) ? REPEAT_MAX + 1 : num;
+      s = num_end;
+    }
+  }
+  return (*s == '}') ? (size_t)(s + 1 - p) : 0;
+}
+
+// Two new nodes connected by an edge on 'bytes' or, if it is NULL, by an
+// always edge, which is only taken at the start or end of the line for the
+// anchors '^' and '$'
+nfa* nfa_fragment(regex_parser* rp, const uint64_t* bytes, int anchor)
+{
+  nfa* out = arena_alloc(rp->mem, sizeof(nfa));
+
+  out->start = new_nfa_node(rp->next_id, rp->mem);
+  out->end = new_nfa_node(rp->next_id, rp->mem);
+  out->start->next_l = insert_nfa_edge(NULL, bytes, anchor, out->end, rp->mem);
+  out->num_nodes = 2;
+  return out;
+}
+
+nfa* nfa_concat(regex_parser* rp, nfa* first, nfa* second)
+{
+  first->end->next_l = insert_nfa_edge(first->end->next_l, NULL, 0, second->start, rp->mem);
+  first->end = second->end;
+  return first;
+}
+
+nfa* nfa_alt(regex_parser* rp, nfa* first, nfa* second)
+{
+  nfa* out = nfa_fragment(rp, NULL, 0); // start and end around both
+  out->start->next_l = insert_nfa_edge(NULL, NULL, 0, first->start, rp->mem);
+  out->start->next_l = insert_nfa_edge(out->start->next_l, NULL, 0, second->start, rp->mem);
+  first->end->next_l = insert_nfa_edge(first->end->next_l, NULL, 0, out->end, rp->mem);
+  second->end->next_l = insert_nfa_edge(second->end->next_l, NULL, 0, out->end, rp->mem);
+  return out;
+}
+
+// Repeat the fragment, whose nodes have the ids from first_id on, min to max
+// times (max -1 for no limit). The fragment is copied for every repetition but
+// one. The copies after the first min ones can be skipped and without a
+// maximum the last one loops.
+nfa* nfa_repeat(regex_parser* rp, nfa* unit, int first_id, int min, int max)
+{
+  int past_id = *rp->next_id;
+  int count = (max < 0) ? (min > 0 ? min : 1) : max;
+  nfa** copies;
+  nfa* out = NULL;
+  nfa* piece;
+  nfa* wrap;
+
+  if (max == 0)
+    return nfa_fragment(rp, NULL, 0);
+  if (past_id + (int64_t)(past_id - first_id + 2) * count > NFA_MAX_NODES) {
+    rp->error = "regular expression too big";
+    return unit;
+  }
+  // all copies are made before the fragment is connected to anything else
+  copies = malloc(sizeof(nfa*) * count);
+  copies[0] = unit;
+  for (int i = 1; i < count; i++)
+    copies[i] = nfa_copy(rp, unit, first_id, past_id);
+
+  for (int i = 0; i < count; i++) {
+    piece = copies[i];
+    if (i >= min || (max < 0 && i == count - 1)) {
+      wrap = arena_alloc(rp->mem, sizeof(nfa));
+      wrap->start = new_nfa_node(rp->next_id, rp->mem);
+      wrap->end = new_nfa_node(rp->next_id, rp->mem);
+      wrap->start->next_l = insert_nfa_edge(NULL, NULL, 0, piece->start, rp->mem);
+      piece->end->next_l = insert_nfa_edge(piece->end->next_l, NULL, 0, wrap->end, rp->mem);
+      if (i >= min)
+        wrap->start->next_l = insert_nfa_edge(wrap->start->next_l, NULL, 0, wrap->end, rp->mem);
+      if (max < 0 && i == count - 1)
+        piece->end->next_l = insert_nfa_edge(piece->end->next_l, NULL, 0, piece->start, rp->mem);
+      piece = wrap;
+    }
+    out = (out == NULL) ? piece : nfa_concat(rp, out, piece);
+  }
+  free(copies);
+  return out;
+}
+
+// Copy of the fragment whose nodes have the ids first_id to past_id - 1
+nfa* nfa_copy(regex_parser* rp, nfa* unit, int first_id, int past_id)
+{
+  nfa* out = arena_alloc(rp->mem, sizeof(nfa));
+  nfa_node** copy = calloc(past_id - first_id, sizeof(nfa_node*));
+  nfa_node** stack = malloc(sizeof(nfa_node*) * (past_id - first_id));
+  int top = 0;
+  nfa_node* node;
+  nfa_edge* iter_edge;
+
+  copy[unit->start->id - first_id] = new_nfa_node(rp->next_id, rp->mem);
+  stack[top++] = unit->start;
+  while (top > 0) {
+    node = stack[--top];
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      int to = iter_edge->node->id - first_id;
+      if (copy[to] == NULL) {
+        copy[to] = new_nfa_node(rp->next_id, rp->mem);
+        stack[top++] = iter_edge->node;
+      }
+      copy[node->id - first_id]->next_l = insert_nfa_edge(
+          copy[node->id - first_id]->next_l, iter_edge->bytes, iter_edge->anchor,
+          copy[to], rp->mem);
+    }
+  }
+  out->start = copy[unit->start->id - first_id];
+  out->end = copy[unit->end->id - first_id];
+  out->num_nodes = unit->num_nodes;
+  free(stack);
+  free(copy);
+  return out;
+}
+
+
+// Prefix the NFA with the equivalent of '.*' so that a match can start at any
+// position of the line: the new start node loops back to itself on any
+// character and can always continue with the old start node. Only the
+// closure of the start node follows '^' edges, so they can't be reached
+// through the loop.
+void add_search_loop(nfa* nfa_in, arena* mem)
+{
+  nfa_node* loop = new_nfa_node(&nfa_in->num_nodes, mem); // the next free id
+  uint64_t* any = arena_alloc(mem, sizeof(uint64_t) * 4);
+
+  memset(any, 0xff, sizeof(uint64_t) * 4);
+  any['\n' / 64] &= ~((uint64_t)1 << ('\n' % 64));
+  loop->next_l = insert_nfa_edge(NULL, NULL, 0, nfa_in->start, mem);
+  loop->next_l = insert_nfa_edge(loop->next_l, any, 0, loop, mem);
+  nfa_in->start = loop;
+}
+
+// Whether every match has to start at the start of the line, i.e. no byte
+// edge and no end can be reached from the start node without a '^' edge. The
+// search loop isn't needed then.
+int nfa_anchored(nfa* nfa_in)
+{
+  nfa_node** stack = malloc(sizeof(nfa_node*) * nfa_in->num_nodes);
+  uint8_t* seen = calloc(nfa_in->num_nodes, 1);
+  int top = 0;
+  int anchored = 1;
+  nfa_node* node;
+  nfa_edge* iter_edge;
+
+  stack[top++] = nfa_in->start;
+  seen[nfa_in->start->id] = 1;
+  while (top > 0 && anchored) {
+    node = stack[--top];
+    anchored = !node->isend;
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      if (iter_edge->bytes != NULL || iter_edge->anchor == '$')
+        anchored = 0;
+      else if (iter_edge->anchor == 0 && !seen[iter_edge->node->id]) {
+        seen[iter_edge->node->id] = 1;
+        stack[top++] = iter_edge->node;
+      }
+    }
+  }
+  free(seen);
+  free(stack);
+  return anchored;
+}
+
+
+// Compute the closure over always edges of every NFA node once, so that
+// building a DFA state only takes a union of bitsets per NFA edge instead of
+// walking the always edges again for every state.
+// Also collects the nodes by their id, the set of end nodes, the nodes which
+// reach one at the end of a line and the closure of the start node at the
+// start of a line.
+void nfa_closures(nfa* nfa_in, arena* mem)
+{
+  int num_nodes = nfa_in->num_nodes;
+  int words = (num_nodes + 63) / 64;
+  nfa_node** stack = malloc(sizeof(nfa_node*) * num_nodes);
+  int top = 0;
+  nfa_node* node;
+  nfa_edge* iter_edge;
+  uint64_t* closure;
+  int changed;
+
+  nfa_in->set_words = words;
+  nfa_in->nodes = arena_calloc(mem, num_nodes, sizeof(nfa_node*));
+  nfa_in->closures = arena_calloc(mem, (size_t)num_nodes * words, sizeof(uint64_t));
+  nfa_in->ends = arena_calloc(mem, words, sizeof(uint64_t));
+  nfa_in->eol_ends = arena_calloc(mem, words, sizeof(uint64_t));
+  nfa_in->start_set = arena_calloc(mem, words, sizeof(uint64_t));
+
+  // collect the nodes by their id, ids of nodes which can't be reached from
+  // the start, e.g. of the fragment x{0} replaced, stay NULL
+  nfa_in->nodes[nfa_in->start->id] = nfa_in->start;
+  stack[top++] = nfa_in->start;
+  while (top > 0) {
+    node = stack[--top];
+    if (node->isend)
+      set_add(nfa_in->ends, node->id);
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      if (nfa_in->nodes[iter_edge->node->id] == NULL) {
+        nfa_in->nodes[iter_edge->node->id] = iter_edge->node;
+        stack[top++] = iter_edge->node;
+      }
+    }
+  }
+
+  // depth first walk over the always edges from every node, the closure
+  // itself marks the nodes which have been visited
+  for (int id = 0; id < num_nodes; id++) {
+    if (nfa_in->nodes[id] == NULL)
+      continue;
+    closure = nfa_in->closures + (size_t)id * words;
+    set_add(closure, id);
+    stack[top++] = nfa_in->nodes[id];
+    while (top > 0) {
+      node = stack[--top];
+      for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+        int to = iter_edge->node->id;
+        if (iter_edge->bytes == NULL && iter_edge->anchor == 0 && !set_has(closure, to)) {
+          set_add(closure, to);
+          stack[top++] = iter_edge->node;
+        }
+      }
+    }
+  }
+
+  // the same from the start node but also over '^' edges
+  set_add(nfa_in->start_set, nfa_in->start->id);
+  stack[top++] = nfa_in->start;
+  while (top > 0) {
+    node = stack[--top];
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      int to = iter_edge->node->id;
+      if (iter_edge->bytes == NULL && iter_edge->anchor != '$' &&
+          !set_has(nfa_in->start_set, to)) {
+        set_add(nfa_in->start_set, to);
+        stack[top++] = iter_edge->node;
+      }
+    }
+  }
+
+  // an empty line is both the start and the end of a line, so it matches if
+  // an end node can be reached over any edges without bytes
+  uint64_t* seen = malloc(sizeof(uint64_t) * words);
+  memset(seen, 0, sizeof(uint64_t) * words);
+  nfa_in->empty_line = 0;
+  set_add(seen, nfa_in->start->id);
+  stack[top++] = nfa_in->start;
+  while (top > 0) {
+    node = stack[--top];
+    nfa_in->empty_line |= node->isend;
+    for (iter_edge = node->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+      if (iter_edge->bytes == NULL && !set_has(seen, iter_edge->node->id)) {
+        set_add(seen, iter_edge->node->id);
+        stack[top++] = iter_edge->node;
+      }
+    }
+  }
+  free(seen);
+
+  // nodes from which an end node can be reached over always and '$' edges,
+  // repeated until nothing changes. Most edges lead to higher ids, so going
+  // down from the highest id usually takes a single round.
+  memcpy(nfa_in->eol_ends, nfa_in->ends, sizeof(uint64_t) * words);
+  do {
+    changed = 0;
+    for (int id = num_nodes - 1; id >= 0; id--) {
+      if (nfa_in->nodes[id] == NULL || set_has(nfa_in->eol_ends, id))
+        continue;
+      for (iter_edge = nfa_in->nodes[id]->next_l; iter_edge != NULL; iter_edge = iter_edge->next) {
+        if (iter_edge->bytes == NULL && iter_edge->anchor != '^' &&
+            set_has(nfa_in->eol_ends, iter_edge->node->id)) {
+          set_add(nfa_in->eol_ends, id);
+          changed = 1;
+          break;
+        }
+      }
+    }
+  } while (changed);
+  free(stack);
+}
+
+
+// DFA CACHE
+
+// With --cache-dir the flattened DFA of a pattern is stored in a file of its
+// own, so later runs with the same pattern only map that file instead of
+// building the DFA again. A file is
+//   dfa_cache_header | trans | accept | accept_eol | stop | key
+// where the key is the pattern together with everything else which changes
+// the table, see dfa_cache_key. The file is named after the hash of the key
+// and the key itself tells patterns with the same hash apart. Files of
+// another version, of the wrong size, whose checksum doesn't match or whose
+// states, classes or transitions are out of range are ignored, the DFA is
+// then built as usual and replaces them.
+
+// The key of the DFA of 'pattern', which is a regex or with 'fixed' the '\n'
+// separated -F patterns. Returns it in a malloc'ed buffer of *len bytes.
+char* dfa_cache_key(const char* pattern, size_t pattern_len, int fixed,
+    int minimize, size_t* len)
+{
+  char flags[64];
+  int flags_len = snprintf(flags, sizeof(flags), "%s minimize=%d\n",
+      fixed ? "fixed" : "regex", minimize);
+  char* out = malloc(flags_len + pattern_len);
+
+  memcpy(out, flags, flags_len);
+  memcpy(out + flags_len, pattern, pattern_len);
+  *len = flags_len + pattern_len;
+  return out;
+}
+
+// Path of the file of 'key' in 'dir', malloc'ed
+char* dfa_cache_path(const char* dir, const char* key, size_t key_len)
+{
+  size_t len = strlen(dir) + 1 + 16 + sizeof(".dfa");
+  char* out = malloc(len);
+
+  snprintf(out, len, "%s/%016llx.dfa", dir,
+      (unsigned long long)hash_bytes(HASH_INIT, key, key_len));
+  return out;
+}
+
+// Map the table stored for 'key' in 'dir'. Tables whose transitions take
+// more than 'budget' bytes are not used, a lazy DFA has to be built for them.
+// Returns NULL if there is no usable file.
+dfa_table* dfa_cache_load(const char* dir, const char* key, size_t key_len,
+    size_t budget)
+{
+  char* path = dfa_cache_path(dir, key, key_len);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  const dfa_cache_header* header;
+  const char* map;
+  const uint8_t* flags;
+  size_t trans_len;
+  size_t len;
+  dfa_table* out;
+
+  free(path);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(dfa_cache_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  header = (const dfa_cache_header*)map;
+  trans_len = ((size_t)header->num_states << header->shift) * sizeof(uint32_t);
+  flags = (const uint8_t*)map + sizeof(dfa_cache_header) + trans_len;
+  len = sizeof(dfa_cache_header) + trans_len + 3 * (size_t)header->num_states +
+    key_len;
+  if (memcmp(header->magic, DFA_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != DFA_CACHE_VERSION || header->shift > 8 ||
+      header->num_states > (1u << 24) || len != (size_t)st.st_size ||
+      header->key_len != key_len || trans_len > budget ||
+      memcmp(map + len - key_len, key, key_len) != 0 ||
+      dfa_cache_checksum(header, (const uint32_t*)(map + sizeof(dfa_cache_header)),
+        trans_len, flags, 3 * (size_t)header->num_states, key, key_len)
+        != header->checksum ||
+      !dfa_cache_table_valid(header,
+        (const uint32_t*)(map + sizeof(dfa_cache_header)))) {
+    munmap((void*)map, st.st_size);
+    return NULL;
+  }
+
+  out = malloc(sizeof(dfa_table));
+  out->num_states = header->num_states;
+  out->start = header->start;
+  out->line_match = header->line_match;
+  out->num_classes = header->num_classes;
+  out->shift = header->shift;
+  memcpy(out->classes, header->classes, sizeof(out->classes));
+  // only read while searching, a table which isn't lazy is never changed
+  out->trans = (uint32_t*)(map + sizeof(dfa_cache_header));
+  out->accept = (uint8_t*)flags;
+  out->accept_eol = out->accept + out->num_states;
+  out->stop = out->accept_eol + out->num_states;
+  out->lazy = NULL;
+  out->map = (void*)map;
+  out->map_len = st.st_size;
+  return out;
+}
+
+// Store the table for 'key' in 'dir'. It is written to a file of its own
+// first and then renamed, so other runs only ever see complete files. Errors
+// are ignored, the DFA is just built again next time.
+void dfa_cache_store(const char* dir, const char* key, size_t key_len,
+    const dfa_table* table)
+{
+  char* path = dfa_cache_path(dir, key, key_len);
+  size_t trans_len = ((size_t)table->num_states << table->shift) * sizeof(uint32_t);
+  size_t n = table->num_states;
+  uint8_t* flags = malloc(3 * n); // accept, accept_eol and stop in a row
+  char* tmp_path = malloc(strlen(path) + 3 * sizeof(int) + 6);
+  dfa_cache_header header;
+  struct iovec iov[4] = {
+    {&header, sizeof(header)}, {table->trans, trans_len}, {flags, 3 * n},
+    {(void*)key, key_len}
+  };
+  int fd;
+
+  memcpy(flags, table->accept, n);
+  memcpy(flags + n, table->accept_eol, n);
+  memcpy(flags + 2 * n, table->stop, n);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DFA_CACHE_MAGIC, sizeof(header.magic));
+  header.version = DFA_CACHE_VERSION;
+  header.num_states = table->num_states;
+  header.num_classes = table->num_classes;
+  header.shift = table->shift;
+  header.start = table->start;
+  header.line_match = table->line_match;
+  header.key_len = key_len;
+  memcpy(header.classes, table->classes, sizeof(header.classes));
+  header.checksum = dfa_cache_checksum(&header, table->trans, trans_len, flags,
+      3 * n, key, key_len);
+
+  sprintf(tmp_path, "%s.%d.tmp", path, (int)getpid());
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    if (write_all(fd, iov, 4) != 0 || close(fd) != 0 || rename(tmp_path, path) != 0)
+      unlink(tmp_path);
+  }
+  free(flags);
+  free(tmp_path);
+  free(path);
+}
+
+// Checksum of all parts of a file, the header with its checksum taken as 0
+uint64_t dfa_cache_checksum(const dfa_cache_header* header,
+    const uint32_t* trans, size_t trans_len, const uint8_t* flags,
+    size_t flags_len, const char* key, size_t key_len)
+{
+  dfa_cache_header copy = *header;
+  uint64_t h;
+
+  copy.checksum = 0;
+  h = hash_bytes(HASH_INIT, &copy, sizeof(copy));
+  h = hash_bytes(h, trans, trans_len);
+  h = hash_bytes(h, flags, flags_len);
+  return hash_bytes(h, key, key_len);
+}
+
+// Whether the states and classes of a stored table are in range, so that the
+// search never reads outside of it. The checksum only catches files which
+// were damaged by accident. A stored table is never lazy, so only the row of
+// DFA_UNKNOWN may lead to DFA_UNKNOWN.
+int dfa_cache_table_valid(const dfa_cache_header* header, const uint32_t* trans)
+{
+  uint32_t num_states = header->num_states;
+
+  if (num_states < DFA_FIRST || header->start >= num_states ||
+      header->line_match >= num_states || header->num_classes == 0 ||
+      header->num_classes > (1u << header->shift))
+    return 0;
+  for (int c = 0; c < 256; c++) {
+    if (header->classes[c] >= header->num_classes)
+      return 0;
+  }
+  for (uint32_t s = 0; s < num_states; s++) {
+    const uint32_t* row = trans + ((size_t)s << header->shift);
+    for (uint32_t c = 0; c < header->num_classes; c++) {
+      if (row[c] >= num_states || (row[c] == DFA_UNKNOWN && s != DFA_UNKNOWN))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+
+// SCAN KERNELS
+
+// Searching for a single byte, e.g. '\n', and for the required literal of the
+// regex is where most of the time goes for selective regexes. The kernels
+// below do it 16 (SSE2) or 32 (AVX2) bytes at a time, the fastest one the CPU
+// supports is picked by select_scan_kernels.
+
+const scan_kernels scan_kernel_list[] = {
+  {"scalar", find_byte_scalar, find_pair_scalar},
+#if SCAN_X86
+  {"sse2", find_byte_sse2, find_pair_sse2},
+  {"avx2", find_byte_avx2, find_pair_avx2},
+#endif
+};
+
+const scan_kernels* select_scan_kernels(void)
+{
+#if SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return &scan_kernel_list[2];
+  if (__builtin_cpu_supports("sse2"))
+    return &scan_kernel_list[1];
+#endif
+  return &scan_kernel_list[0];
+}
+
+// Return the first occurrence of the literal of 're' in [p, end) or NULL.
+// Instead of its first byte the kernels look for its two rarest bytes at the
+// right distance from each other, which gives far fewer false candidates.
+// Each candidate costs up to a comparison of the whole literal though, so if
+// they are so frequent that this adds up to more than the text scanned, as
+// for "QQQ...Qe" in a run of Q, the rest is left to memmem, whose Two-Way
+// search is linear in the text.
+const char* find_literal(RE* re, const char* p, const char* end)
+{
+  size_t len = re->literal_len;
+  size_t dist = re->rare1 - re->rare0;
+  unsigned char c0 = re->literal[re->rare0];
+  unsigned char c1 = re->literal[re->rare1];
+  const char* start = p;
+  const char* text_end = end;
+  size_t checked = 0; // bytes of false candidates, at most len each
+  const char* hit;
+
+  if ((size_t)(end - p) < len)
+    return NULL;
+  if (len == 1)
+    return re->scan->find_byte(p, end, c0);
+  // rare0 of a literal which fits before 'end' is at most end - len + rare0
+  end = end - len + re->rare0 + dist + 1;
+  for (p += re->rare0; (hit = re->scan->find_pair(p, end, c0, c1, dist)) != NULL;
+      p = hit + 1) {
+    if (memcmp(hit - re->rare0, re->literal, len) == 0)
+      return hit - re->rare0;
+    checked += len;
+    if (checked > (size_t)(hit - start) + LITERAL_CHECK_SLACK * len) {
+      p = hit - re->rare0 + 1;
+      return memmem(p, text_end - p, re->literal, len);
+    }
+  }
+  return NULL;
+}
+
+// Rough rank of how rare a byte is in text, bytes which are not listed count
+// as rarer than all others
+int byte_rarity(unsigned char c)
+{
+  static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+  const char* p = (c == '\0') ? NULL : strchr(common, c);
+  return (p == NULL) ? (int)sizeof(common) : p - common;
+}
+
+// Pick the offsets rare0 < rare1 of the two rarest bytes of the literal
+void choose_rare_pair(RE* re)
+{
+  size_t first = 0;
+  size_t second = (re->literal_len > 1) ? 1 : 0;
+  const unsigned char* lit = (const unsigned char*)re->literal;
+
+  if (byte_rarity(lit[second]) > byte_rarity(lit[first])) {
+    first = second;
+    second = 0;
+  }
+  for (size_t i = 2; i < re->literal_len; i++) {
+    if (byte_rarity(lit[i]) > byte_rarity(lit[first])) {
+      second = first;
+      first = i;
+    } else if (byte_rarity(lit[i]) > byte_rarity(lit[second])) {
+      second = i;
+    }
+  }
+  re->rare0 = (first < second) ? first : second;
+  re->rare1 = (first < second) ? second : first;
+}
+
+// Portable version which compares 8 bytes at once: after xor with the byte
+// repeated 8 times the word has a zero byte exactly where the byte was.
+const char* find_byte_scalar(const char* p, const char* end, unsigned char c)
+{
+  const uint64_t ones = 0x0101010101010101u;
+  const uint64_t highs = 0x8080808080808080u;
+  uint64_t pattern = ones * c;
+  uint64_t word;
+
+  for (; end - p >= 8; p += 8) {
+    memcpy(&word, p, 8);
+    word ^= pattern;
+    if ((word - ones) & ~word & highs)
+      break; // c is one of the next 8 bytes
+  }
+  for (; p < end; p++)
+    if ((unsigned char)*p == c)
+      return p;
+  return NULL;
+}
+
+// Return the first position x in [p, end - dist) with x[0] == c0 and
+// x[dist] == c1 or NULL.
+const char* find_pair_scalar(const char* p, const char* end, unsigned char c0,
+    unsigned char c1, size_t dist)
+{
+  if ((size_t)(end - p) <= dist)
+    return NULL;
+  for (end -= dist; (p = find_byte_scalar(p, end, c0)) != NULL; p++)
+    if ((unsigned char)p[dist] == c1)
+      return p;
+  return NULL;
+}
+
+#if SCAN_X86
+__attribute__((target("sse2")))
+const char* find_byte_sse2(const char* p, const char* end, unsigned char c)
+{
+  __m128i needle = _mm_set1_epi8(c);
+  int mask;
+
+  for (; end - p >= 16; p += 16) {
+    mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), needle));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("sse2")))
+const char* find_pair_sse2(const char* p, const char* end, unsigned char c0,
+    unsigned char c1, size_t dist)
+{
+  __m128i first = _mm_set1_epi8(c0);
+  __m128i second = _mm_set1_epi8(c1);
+  __m128i a, b;
+  int mask;
+
+  if ((size_t)(end - p) <= dist)
+    return NULL;
+  for (; end - dist - p >= 16; p += 16) {
+    a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), first);
+    b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + dist)), second);
+    mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return find_pair_scalar(p, end, c0, c1, dist);
+}
+
+// 128 bytes per iteration with a single test for all four vectors, the
+// vector with the match is only looked for once there is one
+__attribute__((target("avx2")))
+const char* find_byte_avx2(const char* p, const char* end, unsigned char c)
+{
+  __m256i needle = _mm256_set1_epi8(c);
+  __m256i a, b, d, e, any;
+  unsigned mask;
+
+  for (; end - p >= 128; p += 128) {
+    a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), needle);
+    b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), needle);
+    d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 64)), needle);
+    e = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 96)), needle);
+    any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(d, e));
+    if (!_mm256_testz_si256(any, any)) {
+      if ((mask = _mm256_movemask_epi8(a)) != 0)
+        return p + __builtin_ctz(mask);
+      if ((mask = _mm256_movemask_epi8(b)) != 0)
+        return p + 32 + __builtin_ctz(mask);
+      if ((mask = _mm256_movemask_epi8(d)) != 0)
+        return p + 64 + __builtin_ctz(mask);
+      return p + 96 + __builtin_ctz(_mm256_movemask_epi8(e));
+    }
+  }
+  for (; end - p >= 32; p += 32) {
+    mask = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), needle));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return find_byte_sse2(p, end, c);
+}
+
+__attribute__((target("avx2")))
+const char* find_pair_avx2(const char* p, const char* end, unsigned char c0,
+    unsigned char c1, size_t dist)
+{
+  __m256i first = _mm256_set1_epi8(c0);
+  __m256i second = _mm256_set1_epi8(c1);
+  __m256i a, b;
+  unsigned mask;
+
+  if ((size_t)(end - p) <= dist)
+    return NULL;
+  for (; end - dist - p >= 32; p += 32) {
+    a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), first);
+    b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + dist)), second);
+    mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return find_pair_sse2(p, end, c0, c1, dist);
+}
+#endif
+
+#ifdef KERNEL_BENCH
+// Time stamp counter on x86, nanoseconds elsewhere
+uint64_t bench_ticks(void)
+{
+#if SCAN_X86
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+// Run every kernel over a buffer which doesn't contain what it looks for, so
+// that each call has to scan all of it, and print the bytes scanned per tick.
+// For the rare pair the first byte makes up 1/14 of the buffer.
+// Built with -DKERNEL_BENCH, see kernel_bench.sh.
+int kernel_bench(void)
+{
+  const size_t len = 256 * 1024; // stays in L2 so memory bandwidth doesn't
+                                 // hide differences between the kernels
+  const int reps = 4000;
+  const char letters[] = "etaoin srhldcu";
+  char* buf = malloc(len);
+  uint64_t start;
+  size_t found = 0;
+  // called through a volatile pointer so the compiler can't tell that all
+  // calls return the same
+  void* (*volatile libc_memchr)(const void*, int, size_t) = memchr;
+
+  srand(1);
+  for (size_t i = 0; i < len; i++)
+    buf[i] = letters[rand() % (sizeof(letters) - 1)];
+
+  printf("%-8s %-12s %s\n", "kernel", "search", SCAN_X86 ? "bytes/cycle" : "bytes/ns");
+  start = bench_ticks();
+  for (int r = 0; r < reps; r++)
+    found += libc_memchr(buf, '\n', len) != NULL;
+  printf("%-8s %-12s %.2f\n", "libc", "newline",
+      (double)len * reps / (bench_ticks() - start));
+  for (size_t k = 0; k < sizeof(scan_kernel_list) / sizeof(scan_kernels); k++) {
+    const scan_kernels* kern = &scan_kernel_list[k];
+#if SCAN_X86
+    if ((k == 1 && !__builtin_cpu_supports("sse2")) ||
+        (k == 2 && !__builtin_cpu_supports("avx2")))
+      continue;
+#endif
+    start = bench_ticks();
+    for (int r = 0; r < reps; r++)
+      found += kern->find_byte(buf, buf + len, '\n') != NULL;
+    printf("%-8s %-12s %.2f\n", kern->name, "newline",
+        (double)len * reps / (bench_ticks() - start));
+    start = bench_ticks();
+    for (int r = 0; r < reps; r++)
+      found += kern->find_byte(buf, buf + len, 'Q') != NULL;
+    printf("%-8s %-12s %.2f\n", kern->name, "first byte",
+        (double)len * reps / (bench_ticks() - start));
+    start = bench_ticks();
+    for (int r = 0; r < reps; r++)
+      found += kern->find_pair(buf, buf + len, 'h', 'Q', 3) != NULL;
+    printf("%-8s %-12s %.2f\n", kern->name, "rare pair",
+        (double)len * reps / (bench_ticks() - start));
+  }
+  free(buf);
+  return found != 0; // nothing may be found
+}
+#endif
+
+
+// STATISTICS
+
+stats_time stats_now(void)
+{
+  struct timespec wall, cpu;
+
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  return (stats_time){wall.tv_sec + wall.tv_nsec / 1e9,
+    cpu.tv_sec + cpu.tv_nsec / 1e9};
+}
+
+// Let the calling thread count into 'stats' until stats_thread_end. A thread
+// may do so several times, e.g. one which searches chunks of several files.
+void stats_thread_start(thread_stats* stats)
+{
+  cur_stats = stats;
+  stats->used = 1;
+  stats->phase = PHASE_OTHER;
+  stats->since = stats_now();
+}
+
+void stats_thread_end(void)
+{
+  stats_phase(PHASE_OTHER);
+  cur_stats = NULL;
+}
+
+// Add the time since the thread entered its current phase to that phase and
+// enter 'phase'. Every moment between stats_thread_start and stats_thread_end
+// belongs to exactly one phase. Without --stats this does nothing, it is
+// only called once per buffer or write.
+// Returns the phase the thread was in.
+int stats_phase(int phase)
+{
+  thread_stats* stats = cur_stats;
+  stats_time now;
+  int prev;
+
+  if (stats == NULL)
+    return PHASE_OTHER;
+  now = stats_now();
+  prev = stats->phase;
+  stats->phases[prev].wall += now.wall - stats->since.wall;
+  stats->phases[prev].cpu += now.cpu - stats->since.cpu;
+  stats->phase = phase;
+  stats->since = now;
+  return prev;
+}
+
+// Count the bytes and lines of a buffer which has been searched and the
+// matching lines found in it. Counting the lines takes another pass over the
+// buffer, which goes to PHASE_OTHER.
+void stats_scanned(const char* buf, size_t len, size_t matches)
+{
+  size_t lines = 0;
+
+  if (cur_stats == NULL)
+    return;
+  stats_phase(PHASE_OTHER);
+  for (size_t i = 0; i < len; i++)
+    lines += (buf[i] == '\n');
+  if (len > 0 && buf[len - 1] != '\n')
+    lines++; // the last line of a file without a '\n'
+  cur_stats->bytes += len;
+  cur_stats->lines += lines;
+  cur_stats->matches += matches;
+}
+
+// Add the states which the lazy DFA of 're' has built to the counters of the
+// thread, if it has one
+void stats_lazy(RE* re)
+{
+  if (cur_stats == NULL || re->table == NULL || re->table->lazy == NULL)
+    return;
+  cur_stats->lazy_states += re->table->num_states - DFA_FIRST;
+  cur_stats->lazy_flushes += re->table->lazy->flushes;
+}
+
+// Print the --stats of the whole run to stderr: how the regex was compiled,
+// the totals and a line for each thread which searched anything. 'start' is
+// when main started.
+void print_stats(run_stats* stats, stats_time start)
+{
+  static const char* phase_names[NUM_PHASES] = {"other", "read", "scan", "write"};
+  stats_time now = stats_now();
+  struct timespec cpu;
+  thread_stats sum = {0};
+  thread_stats* t;
+  int lazy = 0;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  fprintf(stderr, "Compile: %.3f ms, CPU %.3f ms, %s\n", stats->compile.wall * 1e3,
+      stats->compile.cpu * 1e3, stats->automaton);
+  if (stats->nfa_nodes > 0)
+    fprintf(stderr, "NFA nodes: %d\n", stats->nfa_nodes);
+  if (stats->num_classes > 0)
+    fprintf(stderr, "Byte classes: %d\n", stats->num_classes);
+  if (stats->dfa_edges > 0)
+    fprintf(stderr, "DFA states: %d, edges: %d\n", stats->dfa_states,
+        stats->dfa_edges);
+  else if (stats->dfa_states > 0)
+    fprintf(stderr, "DFA states: %d\n", stats->dfa_states);
+  if (stats->min_states > 0)
+    fprintf(stderr, "DFA states after minimizing: %d\n", stats->min_states);
+
+  for (int i = 0; i < stats->num_threads; i++) {
+    t = &stats->threads[i];
+    sum.files += t->files;
+    sum.bytes += t->bytes;
+    sum.lines += t->lines;
+    sum.matches += t->matches;
+    sum.lazy_states += t->lazy_states;
+    sum.lazy_flushes += t->lazy_flushes;
+    for (int p = 0; p < NUM_PHASES; p++) {
+      sum.phases[p].wall += t->phases[p].wall;
+      sum.phases[p].cpu += t->phases[p].cpu;
+    }
+    lazy |= t->lazy_states > 0;
+  }
+  fprintf(stderr, "Searched: %zu files, %zu bytes, %zu lines, %zu matching lines\n",
+      sum.files, sum.bytes, sum.lines, sum.matches);
+  if (lazy)
+    fprintf(stderr, "Lazy DFA: %zu states, %d flushes\n", sum.lazy_states,
+        sum.lazy_flushes);
+  fprintf(stderr, "Total: %.3f ms, CPU %.3f ms\n", (now.wall - start.wall) * 1e3,
+      (cpu.tv_sec + cpu.tv_nsec / 1e9) * 1e3);
+
+  // wall and CPU time of each phase in ms, of all threads together and of
+  // each of them
+  for (int i = -1; i < stats->num_threads; i++) {
+    t = (i < 0) ? &sum : &stats->threads[i];
+    if (i >= 0 && !t->used)
+      continue;
+    if (i < 0)
+      fprintf(stderr, "All threads:");
+    else
+      fprintf(stderr, "Thread %d: %zu files, %zu bytes, %zu matching lines,", i,
+          t->files, t->bytes, t->matches);
+    for (int p = 0; p < NUM_PHASES; p++)
+      fprintf(stderr, " %s %.3f/%.3f", phase_names[p], t->phases[p].wall * 1e3,
+          t->phases[p].cpu * 1e3);
+    fprintf(stderr, " ms\n");
+  }
+}
+
+
+// HELPER FUNCTIONS
+
+dfagen_node* find_dfagen_node(dfagen_set* set, const uint64_t* bits, int words, uint32_t hash)
+{
+  dfagen_node* iter;
+  if (set->num_buckets == 0)
+    return NULL;
+  for (iter = set->buckets[hash & (set->num_buckets - 1)]; iter != NULL;
+      iter = iter->hash_next) {
+    if (iter->hash == hash &&
+        memcmp(iter->set, bits, sizeof(uint64_t) * words) == 0)
+      return iter;
+  }
+  return NULL;
+}
+
+// Create a dfagen_node with a new dfa_node for the set of NFA nodes and add it
+// to the hash table, which is doubled in size once it is full.
+dfagen_node* insert_into_dfagen_set(dfagen_set* set, nfa* nfa_in, const uint64_t* bits, uint32_t hash, arena* mem)
+{
+  int words = nfa_in->set_words;
+  dfagen_node* out = arena_alloc(mem, sizeof(dfagen_node));
+  out->set = arena_alloc(mem, sizeof(uint64_t) * words);
+  memcpy(out->set, bits, sizeof(uint64_t) * words);
+  out->hash = hash;
+  out->node = arena_alloc(mem, sizeof(dfa_node));
+  out->node->isend = set_intersects(bits, nfa_in->ends, words);
+  out->node->iseol = set_intersects(bits, nfa_in->eol_ends, words);
+  out->node->next_l = NULL;
+  out->next = NULL;
+
+  if (set->count >= set->num_buckets) {
+    int num_buckets = set->num_buckets ? set->num_buckets * 2 : 64;
+    dfagen_node** buckets = arena_calloc(mem, num_buckets, sizeof(dfagen_node*));
+    dfagen_node* iter;
+    dfagen_node* next;
+    for (int i = 0; i < set->num_buckets; i++) {
+      for (iter = set->buckets[i]; iter != NULL; iter = next) {
+        next = iter->hash_next;
+        iter->hash_next = buckets[iter->hash & (num_buckets - 1)];
+        buckets[iter->hash & (num_buckets - 1)] = iter;
+      }
+    }
+    set->buckets = buckets;
+    set->num_buckets = num_buckets;
+  }
+  out->hash_next = set->buckets[hash & (set->num_buckets - 1)];
+  set->buckets[hash & (set->num_buckets - 1)] = out;
+  set->count++;
+  return out;
+}
+
+nfa_node* new_nfa_node(int* next_id, arena* mem)
+{
+  nfa_node* out = arena_alloc(mem, sizeof(nfa_node));
+  out->id = (*next_id)++;
+  out->isend = 0;
+  out->next_l = NULL;
+  return out;
+}
+
+nfa_edge* insert_nfa_edge(nfa_edge* start, const uint64_t* bytes, int anchor, nfa_node* node, arena* mem)
+{
+  nfa_edge* out = arena_alloc(mem, sizeof(nfa_edge));
+  out->bytes = bytes;
+  out->anchor = anchor;
+  out->node = node;
+  out->next = start;
+  return out;
+}
+
+dfa_edge* insert_dfa_edge(dfa_edge* start, int cls, dfa_node* node, arena* mem)
+{
+  dfa_edge* out = arena_alloc(mem, sizeof(dfa_edge));
+  out->cls = cls;
+  out->node = node;
+  out->next = start;
+  return out;
+}
+
+// Sets of NFA nodes are bitsets of 'words' 64 bit words indexed by node id,
+// sets of bytes are bitsets of 4 words.
+
+int set_has(const uint64_t* a, int bit)
+{
+  return (a[bit / 64] >> (bit % 64)) & 1;
+}
+
+void set_add(uint64_t* a, int bit)
+{
+  a[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// a = a | b
+void set_union(uint64_t* a, const uint64_t* b, int words)
+{
+  for (int i = 0; i < words; i++)
+    a[i] |= b[i];
+}
+
+int set_intersects(const uint64_t* a, const uint64_t* b, int words)
+{
+  for (int i = 0; i < words; i++)
+    if (a[i] & b[i])
+      return 1;
+  return 0;
+}
+
+int set_is_empty(const uint64_t* a, int words)
+{
+  for (int i = 0; i < words; i++)
+    if (a[i])
+      return 0;
+  return 1;
+}
+
+// Continue the hash h, which starts out as HASH_INIT, with 'len' bytes
+uint64_t hash_bytes(uint64_t h, const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  uint64_t word;
+
+  for (; len >= 8; p += 8, len -= 8) { // FNV-1a over whole words
+    memcpy(&word, p, 8);
+    h ^= word;
+    h *= 1099511628211u;
+  }
+  for (; len > 0; p++, len--) {
+    h ^= *p;
+    h *= 1099511628211u;
+  }
+  return h;
+}
+
+uint32_t hash_set(const uint64_t* a, int words)
+{
+  uint64_t h = HASH_INIT; // FNV-1a over whole words
+  for (int i = 0; i < words; i++) {
+    h ^= a[i];
+    h *= 1099511628211u;
+  }
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+  arena_chunk* chunk;
+  size_t chunk_size;
+  void* out;
+
+  // keep every allocation aligned like malloc does
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  if (a->chunks == NULL || a->used + size > a->chunks->size) {
+    chunk_size = (a->chunks == NULL) ? ARENA_CHUNK : a->chunks->size * 2;
+    while (chunk_size < size)
+      chunk_size *= 2;
+    chunk = malloc(sizeof(arena_chunk) + chunk_size);
+    chunk->next = a->chunks;
+    chunk->size = chunk_size;
+    a->chunks = chunk;
+    a->used = 0;
+  }
+  out = (char*)a->chunks->data + a->used;
+  a->used += size;
+  return out;
+}
+
+void* arena_calloc(arena* a, size_t count, size_t size)
+{
+  void* out = arena_alloc(a, count * size);
+  memset(out, 0, count * size);
+  return out;
+}
+
+// Give back everything but the newest, i.e. largest, chunk which is used
+// again from the start
+void arena_reset(arena* a)
+{
+  arena_chunk* next;
+  if (a->chunks == NULL)
+    return;
+  for (arena_chunk* iter = a->chunks->next; iter != NULL; iter = next) {
+    next = iter->next;
+    free(iter);
+  }
+  a->chunks->next = NULL;
+  a->used = 0;
+}
+
+
+// DEALLOCATION
+
+// the lazy DFA and its NFA belong to the arena of the RE
+void free_dfa_table(dfa_table* table)
+{
+  if (table->map != NULL) {
+    munmap(table->map, table->map_len);
+  } else {
+    free(table->trans);
+    free(table->accept);
+    free(table->accept_eol);
+    free(table->stop);
+  }
+  free(table);
+}
+
+void arena_free(arena* a)
+{
+  arena_chunk* next;
+  for (arena_chunk* iter = a->chunks; iter != NULL; iter = next) {
+    next = iter->next;
+    free(iter);
+  }
+  a->chunks = NULL;
+  a->used = 0;
+}
+
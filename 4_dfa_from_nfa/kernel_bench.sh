@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Print the bytes per cycle of every scan kernel which this CPU supports.
+# The kernels are timed with the time stamp counter, on other architectures
+# than x86 bytes per nanosecond are printed instead.
+# Usage: ./kernel_bench.sh
+
+set -e
+
+${CC:-cc} -O2 -DKERNEL_BENCH -o kernel_bench cgrep.c
+./kernel_bench
+rm kernel_bench
@@ -3,7 +3,9 @@
 
 make cgrep
 
-tests=('{' '.*' '^{' '^{$' '..;' ';$' '.*;$' 'edge. ' 'str(str)*')
+tests=('{' '.*' '^{' '^{$' '..;' ';$' '.*;$' 'edge. ' 'str(str)*'
+  'int|char' '[a-z]+;$' '(a|b)c?' 'l{2,}' '^[[:space:]]*//' '\w+_\w+\('
+  '$^[[:space:]]?' '$^^|.')
 
 passed=0
 for regex in "${tests[@]}"; do
@@ -19,9 +21,7 @@ for regex in "${tests[@]}"; do
     exit 1
   fi
   ./cgrep "$regex" cgrep.c > cgrepout
-  regexgrep="${regex/\(/\\\(}"
-  regexgrep="${regexgrep/\)/\\\)}"
-  grep "${regexgrep}" cgrep.c > grepout
+  grep -E "$regex" cgrep.c > grepout
   if [[ -n "$(diff cgrepout grepout)" ]]; then
     echo "Failed on this regex: '$regex'"
     if [[ $1 == "-v" ]]; then
@@ -44,5 +44,202 @@ done
 echo "---------------------------------"
 echo "Passed $passed/${#tests[@]} tests"
 
+# the second run of each regex maps the DFA stored by the first one
+cache_dir=$(mktemp -d)
+for regex in "${tests[@]}"; do
+  for run in stored mapped; do
+    ./cgrep --cache-dir="$cache_dir" "$regex" cgrep.c > cgrepout
+    grep -E "$regex" cgrep.c > grepout
+    if [[ -n "$(diff cgrepout grepout)" ]]; then
+      echo "Failed on this regex with a $run DFA: '$regex'"
+      rm -r "$cache_dir"
+      exit 1
+    fi
+  done
+done
+rm -r "$cache_dir"
+
+# a damaged file is ignored and the DFA built again, here the start state
+cache_dir=$(mktemp -d)
+./cgrep --cache-dir="$cache_dir" 'edge. ' cgrep.c > /dev/null
+printf '\xff\xff\xff\x7f' | dd of="$(echo "$cache_dir"/*.dfa)" bs=1 seek=24 \
+  conv=notrunc 2>/dev/null
+./cgrep --cache-dir="$cache_dir" 'edge. ' cgrep.c > cgrepout
+grep -E 'edge. ' cgrep.c > grepout
+rm -r "$cache_dir"
+if [[ -n "$(diff cgrepout grepout)" ]]; then
+  echo "Failed with a damaged file of the DFA cache"
+  exit 1
+fi
+echo "Passed all tests with the DFA cache"
+
+# --stats must not change the output and has to count the same lines as grep
+for regex in "${tests[@]}"; do
+  ./cgrep --stats "$regex" cgrep.c > cgrepout 2> stats
+  grep -E "$regex" cgrep.c > grepout
+  matches=$(sed -n 's/^Searched: .*, \([0-9]*\) matching lines$/\1/p' stats)
+  if [[ -n "$(diff cgrepout grepout)" || "$matches" != "$(wc -l < grepout)" ]]; then
+    echo "Failed on this regex with --stats: '$regex'"
+    rm stats
+    exit 1
+  fi
+done
+rm stats
+echo "Passed all tests with --stats"
+
+# regexes whose DFAs blow up have to fall back to the lazy DFA quickly, the
+# eager attempt takes about 5 ms
+for regex in "$(printf 'a.%.0s' {1..1000})" '[ab]*a[ab]{20}x' 'e.{30}e.{30}$'; do
+  timeout 5 ./cgrep --stats "$regex" cgrep.c > cgrepout 2> stats
+  status=$?
+  grep -E "$regex" cgrep.c > grepout
+  compile_ms=$(sed -n 's/^Compile: \([0-9]*\)\..*/\1/p' stats)
+  if [[ $status -eq 124 || -n "$(diff cgrepout grepout)" ||
+    ${compile_ms:-1000} -ge 100 ]]; then
+    echo "Failed on this regex within 100 ms: '${regex:0:40}'"
+    rm stats
+    exit 1
+  fi
+done
+rm stats
+echo "Passed all tests of DFAs which blow up"
+
+# Run cgrep with the number of threads given first and grep -E with the
+# remaining arguments, which have to give the same output and exit status
+compare() {
+  local threads=$1
+  shift
+  ./cgrep "$threads" "$@" > cgrepout 2>/dev/null
+  local status=$?
+  grep -E "$@" > grepout 2>/dev/null
+  if [[ $? -ne $status || -n "$(diff cgrepout grepout)" ]]; then
+    echo "Failed with $threads: $*"
+    exit 1
+  fi
+}
+
+# the lines of several files are printed in the order of the files however
+# many threads search them
+files=(cgrep.c test.sh bench.sh missing_file kernel_bench.sh ../README.md)
+for threads in -j1 -j4; do
+  for regex in "${tests[@]}"; do
+    compare $threads "$regex" "${files[@]}"
+  done
+done
+echo "Passed all tests with several files"
+
+# the modes which stop early have to agree with grep on what they print and
+# on the exit status, also with a file which can't be opened
+for threads in -j1 -j4; do
+  for mode in -c -l -L -q "-m 0" "-m 1" "-m 3" "-c -m 2" "-l -m 1"; do
+    for regex in "${tests[@]}" 'no such line'; do
+      compare $threads $mode "$regex" "${files[@]}"
+      compare $threads $mode "$regex" cgrep.c
+    done
+  done
+done
+echo "Passed all tests of -c, -l, -L, -q and -m"
+
+# files of at least 8 MiB are split into chunks, the lines of 1 MiB make sure
+# that the ends of some of them are in the middle of a line
+big_file=$(mktemp)
+long_line="int $(head -c 1048576 /dev/zero | tr '\0' x) edge. str;"
+for i in {1..9}; do
+  cat cgrep.c
+  echo "$long_line"
+done > "$big_file"
+for threads in -j1 -j4; do
+  for regex in "${tests[@]}"; do
+    compare $threads "$regex" "$big_file"
+    compare $threads -c "$regex" "$big_file"
+  done
+done
+rm "$big_file"
+echo "Passed all tests with a file in chunks"
+
+# -r writes the files in the order they are done, so the outputs are sorted.
+# Files with a NUL byte are skipped like with grep -I.
+tree=$(mktemp -d)
+mkdir -p "$tree/src/sub" "$tree/doc"
+cp cgrep.c test.sh "$tree/src"
+cp bench.sh "$tree/src/sub"
+cp ../README.md "$tree/doc"
+printf 'int char\0edge. str;\n' > "$tree/src/binary"
+for filter in "" "--include=*.c" "--exclude=*.sh" "--exclude-dir=sub" \
+  "--include=*.sh --exclude=test*"; do
+  for mode in "" -c -l -L; do
+    for regex in "${tests[@]}"; do
+      ./cgrep -j4 -r $mode $filter "$regex" "$tree" 2>/dev/null | sort > cgrepout
+      status=${PIPESTATUS[0]}
+      grep -E -I -r $mode $filter "$regex" "$tree" 2>/dev/null | sort > grepout
+      if [[ ${PIPESTATUS[0]} -ne $status || -n "$(diff cgrepout grepout)" ]]; then
+        echo "Failed on this regex with -r $mode $filter: '$regex'"
+        rm -r "$tree"
+        exit 1
+      fi
+    done
+  done
+done
+rm -r "$tree"
+echo "Passed all tests with -r"
+
+# -f takes the lines of a file as alternatives, -F as strings. The words of
+# cgrep.c are a list large enough for Aho-Corasick.
+words=$(mktemp)
+regexes=$(mktemp)
+strings=$(mktemp)
+grep -o -E '[A-Za-z_]{3,}' cgrep.c | sort -u > "$words"
+printf '%s\n' "${tests[@]}" > "$regexes"
+printf '%s\n' '(a|b)' 'l{2,}' '.*' 'str(str)*' '' 'x+y' > "$strings"
+for threads in -j1 -j4; do
+  for mode in "" -c -l; do
+    for list in "$words" "$regexes" "$strings"; do
+      compare $threads $mode -f "$list" "${files[@]}"
+      ./cgrep $threads $mode -F -f "$list" "${files[@]}" > cgrepout 2>/dev/null
+      status=$?
+      grep -F $mode -f "$list" "${files[@]}" > grepout 2>/dev/null
+      if [[ $? -ne $status || -n "$(diff cgrepout grepout)" ]]; then
+        echo "Failed with $threads $mode -F -f $list"
+        exit 1
+      fi
+    done
+    for argument in 'int' 'int\nchar' 'l{2,}\n.*'; do
+      ./cgrep $threads $mode -F "$(printf "$argument")" "${files[@]}" > cgrepout 2>/dev/null
+      status=$?
+      grep -F $mode "$(printf "$argument")" "${files[@]}" > grepout 2>/dev/null
+      if [[ $? -ne $status || -n "$(diff cgrepout grepout)" ]]; then
+        echo "Failed with $threads $mode -F '$argument'"
+        exit 1
+      fi
+    done
+  done
+done
+
+# a list of regexes with too many NFA nodes fails right away
+for i in {1..5000}; do
+  echo "$i+"
+done > "$regexes"
+timeout 5 ./cgrep -f "$regexes" cgrep.c &>/dev/null
+if [[ $? -ne 2 ]]; then
+  echo "Failed on a list of 5000 regexes"
+  exit 1
+fi
+rm "$words" "$regexes" "$strings"
+echo "Passed all tests with -f and -F"
+
+# a bound at the start repeats nothing like in grep, escapes a DFA can't match
+# are rejected instead of standing for the character
+for regex in '{1}int' '(|{2})char' 'a|{1,}' '[[:digit:]-]'; do
+  compare -j1 "$regex" cgrep.c
+done
+for regex in 'int\b' '\Bnt' '\<int' 'int\>' '(int)\1' '[[:digit:]-z]'; do
+  ./cgrep "$regex" cgrep.c &>/dev/null
+  if [[ $? -ne 2 ]]; then
+    echo "Failed to reject this regex: '$regex'"
+    exit 1
+  fi
+done
+echo "Passed all tests of special cases of the syntax"
+
 rm cgrepout
 rm grepout
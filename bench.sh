@@ -0,0 +1,231 @@
+#!/bin/bash
+
+# Run the cgrep of every stage and grep -E over generated corpora and print
+# one CSV line per engine, corpus and regex to stdout. Progress goes to stderr.
+# Usage: ./bench.sh [size in MB] [time limit per run in seconds]
+#
+# Columns:
+#   engine       1 to 4 for the stages, grep for grep -E
+#   corpus       log, source, long_lines, pathological or repeats
+#   regex
+#   bytes        size of the corpus
+#   seconds      best wall clock time out of $runs runs
+#   mb_per_s
+#   compile_ms   best time of a run over an empty file, i.e. the regex
+#                compiler and start up
+#   peak_rss_kb  maximum resident set size of the best run, sampled every
+#                half millisecond so it's NA or too low for very short runs
+#   dfa_states   states of the stage 4 DFA, "lazy" if it is built lazily
+#   status       ok, mismatch (output differs from grep -E), timeout,
+#                unsupported (the stage doesn't know the syntax) or error
+#
+# Times and the peak RSS are taken with python3 if it is installed, otherwise
+# only the times are and peak_rss_kb is NA.
+
+set -e
+
+root=$(cd "$(dirname "$0")" && pwd)
+size_mb=${1:-8}
+limit=${2:-10}
+runs=3
+engines=(1 2 3 4 grep)
+dirs=("" 1_backtracking 2_simple_nfa 3_nfa_more_regex 4_dfa_from_nfa)
+
+# corpus, first stage which supports the syntax, regex
+cases=(
+  'log|1|ERROR'
+  'log|1|time.*out$'
+  'log|1|^2024-01-0'
+  'log|1|e.*r.*o.*x'
+  'log|1|x'
+  'log|4|(ERROR|WARN) .*disk$'
+  'source|1|;$'
+  'source|1|.*;$'
+  'source|3|str(str)*'
+  'source|4|int|char'
+  'source|4|[a-z]+_[a-z]+\('
+  'long_lines|1|cache.*disk.*timeout'
+  'long_lines|1|zzz'
+  'pathological|1|a*a*a*a*a*a*b'
+  'pathological|3|(a*)*b'
+  'pathological|4|(a|aa)*b'
+  # a long literal whose rarest bytes are found at every position of the
+  # corpus, each check of a candidate used to compare up to 5000 bytes
+  "repeats|1|$(printf 'Q%.0s' {1..5000})e"
+)
+
+for d in "${dirs[@]:1}"; do
+  make -s -B -C "$root/$d" cgrep CFLAGS="-O2" >&2
+done
+
+data=$(mktemp -d)
+trap 'rm -r "$data"' EXIT
+
+# deterministic log-like lines, the same as 4_dfa_from_nfa/bench.sh
+awk -v size=$((size_mb * 1024 * 1024)) 'BEGIN {
+  srand(1);
+  split("INFO DEBUG WARN ERROR", level, " ");
+  split("connection request timeout worker cache disk user session", word, " ");
+  while (bytes < size) {
+    line = sprintf("2024-01-%02d %02d:%02d:%02d %s", int(rand() * 28) + 1,
+      int(rand() * 24), int(rand() * 60), int(rand() * 60),
+      level[int(rand() * 4) + 1]);
+    n = int(rand() * 12) + 2;
+    for (i = 0; i < n; i++)
+      line = line " " word[int(rand() * 8) + 1];
+    print line;
+    bytes += length(line) + 1;
+  }
+}' > "$data/log"
+
+# the sources of all stages, repeated
+while (( $(stat -c %s "$data/source" 2>/dev/null || echo 0) < size_mb * 1024 * 1024 )); do
+  cat "$root"/*/cgrep.c >> "$data/source"
+done
+
+# lines of 64 KiB of the log words
+awk -v size=$((size_mb * 1024 * 1024)) 'BEGIN {
+  srand(2);
+  split("connection request timeout worker cache disk user session", word, " ");
+  while (bytes < size) {
+    line = word[int(rand() * 8) + 1];
+    while (length(line) < 65536)
+      line = line " " word[int(rand() * 8) + 1];
+    print line;
+    bytes += length(line) + 1;
+  }
+}' > "$data/long_lines"
+
+# lines of a which never match the regexes ending in b, small since
+# backtracking takes exponential time on them
+awk 'BEGIN { for (i = 0; i < 2000; i++) { for (j = 0; j < 25; j++) printf "a"; print "" } }' \
+  > "$data/pathological"
+
+# lines of 4000 Q
+awk -v size=$((size_mb * 1024 * 1024)) 'BEGIN {
+  line = "";
+  for (i = 0; i < 4000; i++)
+    line = line "Q";
+  for (bytes = 0; bytes < size; bytes += length(line) + 1)
+    print line;
+}' > "$data/repeats"
+: > "$data/empty"
+
+# measure <output file> <command...>
+# Runs the command with its output in the file and sets 'code', 'secs' and
+# 'rss', code is 124 if it took longer than $limit seconds.
+measure() {
+  local out=$1
+  shift
+  if command -v python3 > /dev/null; then
+    read -r code secs rss < <(python3 - "$limit" "$out" "$@" <<'EOF'
+import subprocess, sys, time
+limit, out = float(sys.argv[1]), sys.argv[2]
+
+# The rusage of a child includes the memory of the python process it was
+# forked from, so sample the high water mark of the child itself instead.
+def hwm(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return 0
+
+start = time.perf_counter()
+rss = 0
+with open(out, "w") as f:
+    p = subprocess.Popen(sys.argv[3:], stdout=f)
+    while p.poll() is None:
+        rss = max(rss, hwm(p.pid))
+        if time.perf_counter() - start > limit:
+            p.kill()
+            p.wait()
+            break
+        time.sleep(0.0005)
+secs = time.perf_counter() - start
+code = 124 if p.returncode == -9 else p.returncode
+print(code, "%.4f" % secs, rss if rss > 0 else "NA")
+EOF
+)
+  else
+    local start end
+    start=$(date +%s.%N)
+    code=0
+    timeout "$limit" "$@" > "$out" || code=$?
+    end=$(date +%s.%N)
+    secs=$(awk "BEGIN { printf \"%.4f\", $end - $start }")
+    rss=NA
+  fi
+}
+
+# engine_cmd <engine>: prints the command of the engine
+engine_cmd() {
+  if [[ $1 == grep ]]; then
+    echo "grep -E"
+  else
+    echo "$root/${dirs[$1]}/cgrep"
+  fi
+}
+
+echo "engine,corpus,regex,bytes,seconds,mb_per_s,compile_ms,peak_rss_kb,dfa_states,status"
+for c in "${cases[@]}"; do
+  IFS='|' read -r corpus min_stage regex <<< "$c"
+  file="$data/$corpus"
+  bytes=$(stat -c %s "$file")
+  # grep's output is what every stage has to print
+  grep -E -- "$regex" "$file" > "$data/expected" || true
+
+  for engine in "${engines[@]}"; do
+    echo "$engine $corpus '$regex'" >&2
+    dfa_states=NA
+    compile_ms=NA
+    best=""
+    best_rss=NA
+    status=ok
+    if [[ $engine != grep ]] && (( engine < min_stage )); then
+      echo "$engine,$corpus,\"$regex\",$bytes,NA,NA,NA,NA,NA,unsupported"
+      continue
+    fi
+    read -r -a cmd <<< "$(engine_cmd "$engine")"
+
+    for ((r = 0; r < runs; r++)); do
+      measure "$data/out" "${cmd[@]}" "$regex" "$file"
+      if [[ $code == 124 ]]; then
+        status=timeout
+        break
+      elif (( code > 1 )); then
+        status=error
+        break
+      fi
+      if [[ -z "$best" ]] || awk "BEGIN { exit !($secs < $best) }"; then
+        best=$secs
+        best_rss=$rss
+      fi
+    done
+    if [[ $status == ok ]] && ! cmp -s "$data/out" "$data/expected"; then
+      status=mismatch
+    fi
+    if [[ $status != ok && $status != mismatch ]]; then
+      echo "$engine,$corpus,\"$regex\",$bytes,NA,NA,NA,NA,NA,$status"
+      continue
+    fi
+
+    for ((r = 0; r < runs; r++)); do
+      measure /dev/null "${cmd[@]}" "$regex" "$data/empty"
+      ms=$(awk "BEGIN { printf \"%.2f\", $secs * 1000 }")
+      if [[ $compile_ms == NA ]] || awk "BEGIN { exit !($ms < $compile_ms) }"; then
+        compile_ms=$ms
+      fi
+    done
+    if [[ $engine == 4 ]]; then
+      dfa_states=$("${cmd[@]}" --dfa-stats "$regex" "$data/empty" 2>&1 >/dev/null |
+        sed -n 's/^DFA states: built lazily.*/lazy/p; s/^DFA states: \([0-9][0-9]*\).*/\1/p')
+    fi
+    printf '%s,%s,"%s",%s,%s,%.1f,%s,%s,%s,%s\n' "$engine" "$corpus" "$regex" \
+      "$bytes" "$best" "$(awk "BEGIN { print $bytes / 1048576 / ($best > 0 ? $best : 0.0001) }")" \
+      "$compile_ms" "$best_rss" "${dfa_states:-NA}" "$status"
+  done
+done